@@ -0,0 +1,243 @@
+#include <iostream>
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <cctype>
+
+#include "batch.hpp"
+
+
+Batch::Batch(NoGo &nogo_engine, bool json) :
+    nogo_engine(nogo_engine)
+{
+    this->m_json = json;
+}
+
+int Batch::run(std::istream &positions, std::ostream &results)
+/* Solve the positions one by one, writing the result of each as soon as it is solved.
+ * Blank lines and lines starting with '#' are skipped.
+ * Returns the number of positions left unsolved: invalid, or out of budget. */
+{
+    if (m_json) {
+        results << "[";
+    }
+    else {
+        results << "line,position,player,value,move,nodes,seconds,table_nodes,status\n";
+    }
+
+    int num_results = 0;
+    int num_unsolved = 0;
+    std::string line;
+    for (int line_no = 1; std::getline(positions, line); line_no++) {
+        size_t first = line.find_first_not_of(" \t\r");
+        if (first == std::string::npos || line[first] == '#') {
+            continue;
+        }
+        line = line.substr(first, line.find_last_not_of(" \t\r") - first + 1);
+
+        m_budget.restart();
+        std::string error;
+        bool valid = set_position(line, error);
+        int value = -1;
+        int move = -1;
+        std::string status;
+        if (valid) {
+            value = nogo_engine.solve(&m_budget);
+            if (value == -1) {
+                status = m_budget.stop_reason.load();
+            }
+            else {
+                status = "solved";
+                if (value == 1) {
+                    move = winning_move();
+                }
+            }
+        }
+        else {
+            status = error;
+        }
+        if (value == -1) {
+            num_unsolved++;
+        }
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - m_budget.start;
+
+        std::string player;
+        std::string value_str = (value == -1) ? (m_json ? "null" : "") : std::to_string(value);
+        std::string move_str;
+        if (valid) {
+            player = (nogo_engine.board.current_player == BLACK) ? "b" : "w";
+        }
+        if (move != -1) {
+            move_str = GoBoardUtil::point_to_string(move, nogo_engine.board.size);
+        }
+
+        std::ostringstream out;
+        out << std::fixed << std::setprecision(3);
+        if (m_json) {
+            out << (num_results == 0 ? "\n" : ",\n")
+                << "{\"line\": " << line_no
+                << ", \"position\": " << quoted(line, true)
+                << ", \"player\": " << (valid ? quoted(player, true) : "null")
+                << ", \"value\": " << value_str
+                << ", \"move\": " << (move != -1 ? quoted(move_str, true) : "null")
+                << ", \"nodes\": " << m_budget.nodes_searched.load()
+                << ", \"seconds\": " << seconds.count()
+                << ", \"table_nodes\": " << nogo_engine.hash.size()
+                << ", \"status\": " << quoted(status, true) << "}";
+        }
+        else {
+            out << line_no << "," << quoted(line, false) << "," << player << ","
+                << value_str << "," << move_str << "," << m_budget.nodes_searched.load() << ","
+                << seconds.count() << "," << nogo_engine.hash.size() << ","
+                << quoted(status, false) << "\n";
+        }
+        results << out.str() << std::flush;     // a killed batch keeps the results so far
+        num_results++;
+    }
+
+    if (m_json) {
+        results << (num_results > 0 ? "\n" : "") << "]\n";
+    }
+    return num_unsolved;
+}
+
+bool Batch::set_position(const std::string &line, std::string &error)
+/* Set up the board from either
+ * - a board string: the rows from top to bottom, optionally separated by '/', with '.' for
+ *   an empty point, 'x' or 'b' for black and 'o' or 'w' for white, then optionally the
+ *   player to move, 'b' or 'w' (by default white if black has more stones, else black); or
+ * - a sequence of moves from the empty board, like "B2 C3 A1", black first.
+ * Returns false with the reason if the line is not a legal position, or if its stones could not
+ * have been played in turn, black first, before the player to move. */
+{
+    nogo_engine.clear_board();
+    NoGoBoard &board = nogo_engine.board;
+    int height = board.size[0];
+    int width = board.size[1];
+
+    std::istringstream tokens(line);
+    std::vector<std::string> args;
+    std::string token;
+    while (tokens >> token) {
+        args.push_back(token);
+    }
+
+    bool is_board = std::none_of(args[0].begin(), args[0].end(), ::isdigit);
+    if (is_board) {
+        std::string points = args[0];
+        points.erase(std::remove(points.begin(), points.end(), '/'), points.end());
+        if ((int) points.size() != height * width || args.size() > 2) {
+            error = "error: not a " + std::to_string(height) + "x" + std::to_string(width) + " board";
+            return false;
+        }
+        int num_stones[3] = {0, 0, 0};
+        for (int i = 0; i < height * width; i++) {
+            char c = std::tolower(points[i]);
+            int color = EMPTY;
+            if (c == 'x' || c == 'b') {
+                color = BLACK;
+            }
+            else if (c == 'o' || c == 'w') {
+                color = WHITE;
+            }
+            else if (c != '.') {
+                error = std::string("error: unknown point '") + points[i] + "'";
+                return false;
+            }
+            if (color == EMPTY) {
+                continue;
+            }
+            int point = GoBoardUtil::coord_to_point(height - i / width, i % width + 1, board.size);
+            if (! board.play_move(point, color)) {
+                error = "error: illegal stone at " + GoBoardUtil::point_to_string(point, board.size);
+                return false;
+            }
+            num_stones[color]++;
+        }
+        int player = (num_stones[BLACK] > num_stones[WHITE]) ? WHITE : BLACK;
+        if (args.size() == 2) {
+            std::string to_play = args[1];
+            std::transform(to_play.begin(), to_play.end(), to_play.begin(), ::tolower);
+            if (to_play != "b" && to_play != "w") {
+                error = "error: unknown player '" + args[1] + "'";
+                return false;
+            }
+            player = (to_play == "b") ? BLACK : WHITE;
+        }
+        // the table is keyed by the stones alone, and shared by all lines: the player to move must
+        // be the one a game from the empty board, black first, would give, or its values would be
+        // stored for the wrong player; ranked keys cover no other positions either
+        int lead = num_stones[BLACK] - num_stones[WHITE];
+        if (lead < 0 || lead > 1 || player != (lead == 0 ? BLACK : WHITE)) {
+            error = "error: stones do not alternate from black with this player to move";
+            return false;
+        }
+        board.current_player = player;
+        return true;
+    }
+
+    int color = BLACK;
+    for (const std::string &move : args) {
+        int point;
+        if (! parse_point(move, point)) {
+            error = "error: unknown move '" + move + "'";
+            return false;
+        }
+        if (! board.play_move(point, color)) {
+            error = "error: illegal move " + move;
+            return false;
+        }
+        color = GoBoardUtil::opponent(color);
+    }
+    return true;
+}
+
+bool Batch::parse_point(const std::string &point_str, int &point)
+/* Parse a point like "B2", with the column as a letter and the row as a number from the bottom */
+{
+    int height = nogo_engine.board.size[0];
+    int width = nogo_engine.board.size[1];
+    if (point_str.size() < 2 || point_str.size() > 3) {
+        return false;
+    }
+    int col = std::toupper(point_str[0]) - 'A' + 1;
+    std::string row_str = point_str.substr(1);
+    if (! std::all_of(row_str.begin(), row_str.end(), ::isdigit)) {
+        return false;
+    }
+    int row = std::stoi(row_str);
+    if (col < 1 || col > width || row < 1 || row > height) {
+        return false;
+    }
+    point = GoBoardUtil::coord_to_point(row, col, nogo_engine.board.size);
+    return true;
+}
+
+int Batch::winning_move()
+/* A move of the current player to a losing child in the table; -1 if there is none */
+{
+    NoGoBoard &board = nogo_engine.board;
+    Grid board2d = board.twoD_board();
+    uint64_t hashcode = nogo_engine.hash.hash_func(board2d);
+    std::vector<int> legal_moves = board.generate_legal_moves(board.current_player);
+    int idx = nogo_engine.search.h_etc(hashcode, legal_moves, board.current_player);
+    return (idx == -1) ? -1 : legal_moves[idx];
+}
+
+std::string quoted(const std::string &s, bool json)
+/* Quote a field of CSV (doubling the quotes) or a JSON string (escaping quotes and backslashes) */
+{
+    std::string q = "\"";
+    for (char c : s) {
+        if (c == '"') {
+            q += json ? "\\\"" : "\"\"";
+        }
+        else if (c == '\\' && json) {
+            q += "\\\\";
+        }
+        else {
+            q += c;
+        }
+    }
+    return q + "\"";
+}
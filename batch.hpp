@@ -0,0 +1,34 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+#include <iostream>
+
+#include "nogo_solver.hpp"
+
+
+class Batch
+/* Solve a file of positions, one per line, without a GTP connection.
+ * All positions share the table of the engine, so positions that transpose
+ * into each other reuse what the earlier solves left in it. */
+{
+public:
+    NoGo nogo_engine;
+    bool m_json = false;    // write results as JSON instead of CSV
+    SolveBudget m_budget;   // limits of the solve of each position
+
+    Batch(NoGo &nogo_engine, bool json=false);
+    ~Batch() {};
+
+    int run(std::istream &positions, std::ostream &results);
+
+private:
+    bool set_position(const std::string &line, std::string &error);
+
+    bool parse_point(const std::string &point_str, int &point);
+
+    int winning_move();
+};
+
+std::string quoted(const std::string &s, bool json);
+
+#endif
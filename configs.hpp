@@ -12,10 +12,32 @@ const int N_ROWS = 5;
 const int N_COLS = 5;
 
 
-/* params for transposition (hashing) table */
-const unsigned int IDX_BITS = 30;   // num bits: index
-const unsigned int CODE_BITS = 10;  // num bits: validation code
-const unsigned int ENTRY_SIZE = 2;  // num bytes: of an entry in table
+/* params for transposition (hashing) table
+ * index and code bits are chosen at run time for each board size:
+ * together they cover all 3^(rows*cols) hashcodes, with as many index bits
+ * as DIRECTORY_BUDGET allows while leaving at least MIN_CODE_BITS for the code */
+const uint64_t DIRECTORY_BUDGET = (uint64_t) 8 << 30;   // num bytes: of the directory
+const unsigned int MIN_CODE_BITS = 10;  // num bits: validation code
+const bool RANKED_KEYS = false;     // key positions by a dense rank instead of their base-3 code (up to 32 points)
+const bool LAYERED_TABLE = false;   // one directory per number of stones, sharing the budget (up to 36 points)
+const bool GROW_DIRECTORY = false;  // start with INITIAL_IDX_BITS index bits and double the directory
+const unsigned int INITIAL_IDX_BITS = 20;   // up to the budget, whenever buckets hold GROW_LOAD entries on average
+const uint64_t GROW_LOAD = 4;
+const bool PACK_ENTRIES = true;     // store entries in exactly (code bits + 2) bits instead of whole bytes:
+                                    // 12 instead of 16 bits at 10-bit codes, probed 4 per word without SIMD
+                                    // rather than 8 (SSE2) or 16 (AVX2) at a time
+const unsigned int SLOT_SIZE = 8;   // num bytes: of a directory slot (8: pointers; 4 or 5: offsets into
+                                    // the CustomMemoryManager pool, in units of 2 bytes)
+const unsigned int FRONT_CACHE_BITS = 10;   // num bits: index of a direct-mapped cache of recent probes
+                                            // in front of the table
+const double GC_MEMORY_SHARE = 0.5;    // share of physical memory: resident beyond it, a solve is followed
+                                        // by garbage collection (0: never)
+const bool GC_KEEP_RECENT = true;   // garbage collection keeps the entries in the front cache besides the proof
+const unsigned int MINIMAL_PROOF_PASSES = 4;    // most passes of prove minimal, each sizing the whole table
+const unsigned int SCAN_THREADS = 0;    // threads for table-wide scans: store, load, clear_proof_bit
+                                        // free_buckets and collect_garbage, and for proofs and verification
+                                        // (0: one per hardware thread)
+const bool HUGE_PAGES = false;      // back the directory with transparent huge pages
 
 
 /* which memory manager to use? */
@@ -1,6 +1,8 @@
 #include <iostream>
 #include <cassert>
 #include <fstream>
+#include <algorithm>
+#include <cstdlib>
 
 #include "gtp_connection.hpp"
 
@@ -11,6 +13,11 @@ GtpConnection::GtpConnection(NoGo &nogo_engine, bool debug_mode) :
     this->m_debug_mode = debug_mode;
 }
 
+GtpConnection::~GtpConnection()
+{
+    stop_solve();
+}
+
 void GtpConnection::start_connection()
 {
     std::cerr << "<- CONNECTION READY ->" << std::endl;
@@ -54,6 +61,14 @@ void GtpConnection::get_cmd(std::string &line)
 
 void GtpConnection::execute_cmd(std::string command_name, std::vector<std::string> &args)
 {
+    if (m_solver.joinable() && m_solve_done == true) {
+        m_solver.join();
+    }
+    if (m_solver.joinable() && std::find(commands_while_solving.begin(), commands_while_solving.end(),
+                                         command_name) == commands_while_solving.end()) {
+        respond("busy: solving, use solve_status or solve_abort");
+        return;
+    }
     for (unsigned int i = 0; i < command_names.size(); i++) {
         if (! command_names[i].compare(command_name)) {
             (this->*commands[i])(args);
@@ -75,6 +90,7 @@ void GtpConnection::protocol_version_cmd(std::vector<std::string> &args)
 
 void GtpConnection::quit_cmd(std::vector<std::string> &args)
 {
+    stop_solve();
     m_quit = true;
     respond("quiting...");
 }
@@ -90,9 +106,25 @@ void GtpConnection::version_cmd(std::vector<std::string> &args)
 }
 
 void GtpConnection::boardsize_cmd(std::vector<std::string> &args)
+/* boardsize [size] or boardsize [height] [width];
+ * the transposition table is rebuilt for the new board */
 {
-    nogo_engine.clear_board();
-    std::cerr << "WARNING: Do not change the board size! Modify configs.hpp and re-compile for a different board size.\n";
+    bool valid = args.size() == 1 || args.size() == 2;
+    long size[2] = {0, 0};
+    for (int i = 0; valid == true && i < (int) args.size(); i++) {
+        const char* number = args[i].c_str();
+        char* end = 0;
+        size[i] = std::strtol(number, &end, 10);
+        valid = end != number && *end == '\0' && size[i] >= 1 && size[i] <= MAX_POINTS;
+    }
+    if (args.size() == 1) {
+        size[1] = size[0];
+    }
+    if (valid == false || size[0] * size[1] > MAX_POINTS) {
+        respond("argument error!");
+        return;
+    }
+    nogo_engine.boardsize(size[0], size[1]);
     respond();
 }
 
@@ -190,17 +222,127 @@ void GtpConnection::undo_cmd(std::vector<std::string> &args)
 }
 
 void GtpConnection::solve_cmd(std::vector<std::string> &args)
+/* solve [async] [time <seconds>] [nodes <count>] [memory <MB>]: solve on a thread of its own;
+ * without async, wait for it */
 {
-    int value = nogo_engine.solve();
-    std::string value_s = std::to_string(value);
-    respond(value_s);
+    bool async = false;
+    double seconds = 0;
+    uint64_t nodes = 0;
+    uint64_t memory = 0;
+    bool valid = true;
+    for (int i = 0; valid == true && i < (int) args.size(); i++) {
+        if (args[i] == "async") {
+            async = true;
+            continue;
+        }
+        if (i + 1 == (int) args.size()) {
+            valid = false;
+            break;
+        }
+        const char* number = args[i+1].c_str();
+        char* end = 0;
+        if (args[i] == "time") {
+            seconds = std::strtod(number, &end);
+        }
+        else if (args[i] == "nodes") {
+            nodes = std::strtoull(number, &end, 10);
+        }
+        else if (args[i] == "memory") {
+            memory = std::strtoull(number, &end, 10) << 20;
+        }
+        valid = end != 0 && end != number && *end == '\0';
+        i++;
+    }
+    if (valid == false) {
+        respond("argument error!");
+        return;
+    }
+
+    m_budget.seconds = seconds;
+    m_budget.nodes = nodes;
+    m_budget.memory = memory;
+    m_budget.restart();
+    m_solve_done = false;
+    m_solver = std::thread([this]() {
+        m_solve_value = nogo_engine.solve(&m_budget);
+        m_solve_done = true;
+    });
+    if (async == true) {
+        respond("solving");
+        return;
+    }
+    m_solver.join();
+    respond(solve_result());
+}
+
+void GtpConnection::solve_status_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (m_solver.joinable()) {
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - m_budget.start;
+        uint64_t nodes = m_budget.nodes_searched;
+        uint64_t total = m_budget.estimated_nodes;
+        msg = "running: " + std::to_string(nodes) + " nodes in " + std::to_string((int) seconds.count()) + " s";
+        if (nodes > 0 && total >= nodes) {
+            // the rest of the search is expected to run as fast, and to grow memory as fast per node
+            double seconds_left = (total - nodes) * seconds.count() / nodes;
+            uint64_t memory = resident_bytes();
+            uint64_t growth = memory > m_budget.start_memory ? memory - m_budget.start_memory : 0;
+            uint64_t peak = m_budget.start_memory + (uint64_t) ((double) growth * total / nodes);
+            msg += ", about " + std::to_string(total - nodes) + " nodes and " + std::to_string((int) seconds_left)
+                   + " s left, peak memory about " + std::to_string(peak >> 20) + " MB";
+        }
+    }
+    else if (m_budget.start == std::chrono::steady_clock::time_point()) {
+        msg = "no solve started";
+    }
+    else {
+        msg = "finished: " + solve_result();
+    }
+    respond(msg);
+}
+
+void GtpConnection::solve_abort_cmd(std::vector<std::string> &args)
+{
+    if (m_solver.joinable() == false) {
+        respond("no solve running");
+        return;
+    }
+    stop_solve();
+    respond(solve_result());
+}
+
+std::string GtpConnection::solve_result()
+/* The value of the last solve, or why it stopped; its values so far stay in the table */
+{
+    if (m_solve_value != -1) {
+        return std::to_string(m_solve_value);
+    }
+    return "unknown: " + std::string(m_budget.stop_reason.load()) + " after "
+           + std::to_string(m_budget.nodes_searched) + " nodes";
+}
+
+void GtpConnection::stop_solve()
+{
+    if (m_solver.joinable() == false) {
+        return;
+    }
+    const char* running = 0;
+    m_budget.stop_reason.compare_exchange_strong(running, "aborted");
+    m_solver.join();
 }
 
 void GtpConnection::prove_cmd(std::vector<std::string> &args)
 {
-    bool value = nogo_engine.prove();
-    std::string value_s = std::to_string(value);
-    respond(value_s);
+    std::string msg;
+    if (args.size() > 1 || (args.size() == 1 && args[0] != "minimal")) {
+        msg = "argument error!";
+    }
+    else {
+        bool value = nogo_engine.prove(args.size() == 1);
+        msg = std::to_string(value);
+    }
+    respond(msg);
 }
 
 void GtpConnection::store_solution_cmd(std::vector<std::string> &args)
@@ -225,26 +367,150 @@ void GtpConnection::load_solution_cmd(std::vector<std::string> &args)
     }
     else {
         std::string f_name = args[0];
-        nogo_engine.load_solution(f_name);
-        msg = "solution loaded from [" + f_name + "]";
+        if (nogo_engine.load_solution(f_name).empty()) {
+            msg = "failed to load solution from [" + f_name + "]";
+        }
+        else {
+            msg = "solution loaded from [" + f_name + "]";
+        }
+    }
+    respond(msg);
+}
+
+void GtpConnection::verify_solution_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() != 1) {
+        msg = "argument error!";
+    }
+    else {
+        std::string f_name = args[0];
+        int value = nogo_engine.verify_solution(f_name);
+        if (value == -1) {
+            msg = "failed to verify solution from [" + f_name + "]";
+        }
+        else {
+            msg = "solution of value " + std::to_string(value) + " verified from [" + f_name + "]";
+        }
+    }
+    respond(msg);
+}
+
+void GtpConnection::store_table_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() != 1) {
+        msg = "argument error!";
+    }
+    else {
+        std::string f_name = args[0];
+        nogo_engine.store_table(f_name);
+        msg = "table stored to [" + f_name + "]";
+    }
+    respond(msg);
+}
+
+void GtpConnection::open_table_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() != 1) {
+        msg = "argument error!";
+    }
+    else {
+        std::string f_name = args[0];
+        if (nogo_engine.open_table(f_name).empty()) {
+            msg = "failed to open table from [" + f_name + "]";
+        }
+        else {
+            msg = "table opened from [" + f_name + "]";
+        }
+    }
+    respond(msg);
+}
+
+void GtpConnection::freeze_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() > 1 || (args.size() == 1 && args[0] != "all")) {
+        msg = "argument error!";
+    }
+    else {
+        int64_t bytes = nogo_engine.freeze(args.size() == 0);
+        if (bytes == -1) {
+            msg = "cannot freeze: table is read-only";
+        }
+        else {
+            uint64_t size = nogo_engine.hash.size();
+            msg = "table frozen: " + std::to_string(size) + " nodes in " + std::to_string(bytes) + " bytes";
+        }
+    }
+    respond(msg);
+}
+
+void GtpConnection::store_strategy_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() != 1) {
+        msg = "argument error!";
+    }
+    else {
+        std::string f_name = args[0];
+        int64_t num_moves = nogo_engine.store_strategy(f_name);
+        if (num_moves == -1) {
+            msg = "cannot store strategy: current board is not solved";
+        }
+        else {
+            msg = "strategy of " + std::to_string(num_moves) + " moves stored to [" + f_name + "]";
+        }
+    }
+    respond(msg);
+}
+
+void GtpConnection::load_strategy_cmd(std::vector<std::string> &args)
+{
+    std::string msg;
+    if (args.size() != 1) {
+        msg = "argument error!";
+    }
+    else {
+        std::string f_name = args[0];
+        if (nogo_engine.load_strategy(f_name).empty()) {
+            msg = "failed to load strategy from [" + f_name + "]";
+        }
+        else {
+            msg = "strategy loaded from [" + f_name + "]";
+        }
     }
     respond(msg);
 }
 
 void GtpConnection::search_size_cmd(std::vector<std::string> &args)
 {
-    uint64_t size = hash.size();
+    uint64_t size = nogo_engine.hash.size();
     std::string msg = "size of search: " + std::to_string(size) + " nodes";
     respond(msg);
 }
 
 void GtpConnection::proof_size_cmd(std::vector<std::string> &args)
 {
-    uint64_t proof_size = hash.proof_size();
+    uint64_t proof_size = nogo_engine.hash.proof_size();
     std::string msg = "size of proof: " + std::to_string(proof_size) + " nodes";
     respond(msg);
 }
 
+void GtpConnection::collect_garbage_cmd(std::vector<std::string> &args)
+{
+    int64_t num_dropped = nogo_engine.collect_garbage();
+    std::string msg;
+    if (num_dropped == -1) {
+        msg = "cannot collect garbage: current board is not proved";
+    }
+    else {
+        msg = "garbage collected: " + std::to_string(num_dropped) + " nodes dropped";
+    }
+    respond(msg);
+}
+
 void GtpConnection::stats_cmd(std::vector<std::string> &args)
 {
     // add code below for logging stats
@@ -1,6 +1,8 @@
 #ifndef GTP_CONNECTION_H
 #define GTP_CONNECTION_H
 
+#include <thread>
+
 #include "nogo_solver.hpp"
 
 
@@ -23,11 +25,20 @@ public:
         "komi",
         "list_commands",
         "solve",
+        "solve_status",
+        "solve_abort",
         "prove",
         "store_solution",
         "load_solution",
+        "verify_solution",
+        "store_table",
+        "open_table",
+        "freeze",
+        "store_strategy",
+        "load_strategy",
         "search_size",
         "proof_size",
+        "collect_garbage",
         "stats",
         "debug"
     };
@@ -45,6 +56,15 @@ public:
         "komi",
         "list_commands"
     };
+    std::vector<std::string> commands_while_solving = {
+        "protocol_version",
+        "quit",
+        "name",
+        "version",
+        "list_commands",
+        "solve_status",
+        "solve_abort"
+    };
     std::vector<void (GtpConnection::*)(std::vector<std::string> &args)> commands = {
         &GtpConnection::play_cmd,
         &GtpConnection::genmove_cmd,
@@ -59,18 +79,27 @@ public:
         &GtpConnection::komi_cmd,
         &GtpConnection::list_commands_cmd,
         &GtpConnection::solve_cmd,
+        &GtpConnection::solve_status_cmd,
+        &GtpConnection::solve_abort_cmd,
         &GtpConnection::prove_cmd,
         &GtpConnection::store_solution_cmd,
         &GtpConnection::load_solution_cmd,
+        &GtpConnection::verify_solution_cmd,
+        &GtpConnection::store_table_cmd,
+        &GtpConnection::open_table_cmd,
+        &GtpConnection::freeze_cmd,
+        &GtpConnection::store_strategy_cmd,
+        &GtpConnection::load_strategy_cmd,
         &GtpConnection::search_size_cmd,
         &GtpConnection::proof_size_cmd,
+        &GtpConnection::collect_garbage_cmd,
         &GtpConnection::stats_cmd,
         &GtpConnection::debug_cmd
     };
 
     // GtpConnection(NoGo &nogo_engine, NoGoBoard &board, bool debug_mode=false);
     GtpConnection(NoGo &nogo_engine, bool debug_mode=false);
-    ~GtpConnection() {};
+    ~GtpConnection();
 
     void start_connection();
 
@@ -108,23 +137,48 @@ public:
 
     void solve_cmd(std::vector<std::string> &args);
 
+    void solve_status_cmd(std::vector<std::string> &args);
+
+    void solve_abort_cmd(std::vector<std::string> &args);
+
     void prove_cmd(std::vector<std::string> &args);
 
     void store_solution_cmd(std::vector<std::string> &args);
 
     void load_solution_cmd(std::vector<std::string> &args);
 
+    void verify_solution_cmd(std::vector<std::string> &args);
+
+    void store_table_cmd(std::vector<std::string> &args);
+
+    void open_table_cmd(std::vector<std::string> &args);
+
+    void freeze_cmd(std::vector<std::string> &args);
+
+    void store_strategy_cmd(std::vector<std::string> &args);
+
+    void load_strategy_cmd(std::vector<std::string> &args);
+
     void search_size_cmd(std::vector<std::string> &args);
 
     void proof_size_cmd(std::vector<std::string> &args);
 
+    void collect_garbage_cmd(std::vector<std::string> &args);
+
     void stats_cmd(std::vector<std::string> &args);
 
     void debug_cmd(std::vector<std::string> &args);
 
 private:
     bool m_debug_mode;
-    
+    std::thread m_solver;       // runs solve, while the other commands are answered
+    SolveBudget m_budget;
+    std::atomic<bool> m_solve_done{false};
+    int m_solve_value = -1;
+
+    std::string solve_result();
+
+    void stop_solve();
 };
 
 void string_to_upper(std::string &s);
@@ -1,10 +1,92 @@
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <functional>
 #include <cassert>
 #include <iostream>
+#include <mutex>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
 #include "hash.hpp"
 
 
+static unsigned int num_scan_threads()
+{
+    unsigned int num_threads = SCAN_THREADS > 0 ? SCAN_THREADS : std::thread::hardware_concurrency();
+    return std::max(num_threads, 1u);
+}
+
+template <class L>
+static uint64_t count_less_lanes(const L &layout, uint64_t word, Entry code, uint64_t n)
+/* Number of the first n packed entries of word whose code is smaller than code, all at once:
+ * with the value bit of each lane set, (code - 1) - lane code stays within the lane and
+ * keeps that bit exactly when the lane code is smaller. code must be positive.
+ * The kept bits are summed into the last lane by a multiplication, as x86-64 has no
+ * popcount instruction by default; n is less than 2^entry_bits. */
+{
+    uint64_t value_bits = layout.lane_ones << layout.code_bits;
+    uint64_t lanes = (layout.lane_ones * (code - 1)) | value_bits;
+    uint64_t less = (lanes - (word & (layout.lane_ones * layout.code_mask))) & value_bits;
+    if (n * layout.entry_bits < 64) {
+        less &= ((uint64_t) 1 << (n * layout.entry_bits)) - 1;
+    }
+    return ((less >> layout.code_bits) * layout.lane_ones >> layout.top_lane) & layout.entry_mask;
+}
+
+typedef FixedLayout<MIN_CODE_BITS> CommonLayout;
+
+template <class L>
+static std::array<Entry, 2> probe(const L &layout, Slot slot, Bucket bucket, Entry code)
+/* (entry, found) of code in an inline slot, or else in its bucket */
+{
+    if (SlotUtil::is_inline(slot)) {
+        return SlotUtil::get(layout, slot, code);
+    }
+    return BucketUtil::get(layout, bucket, code);
+}
+
+static unsigned int rice_parameter(unsigned int code_bits, uint64_t bucket_size)
+/* Codes of a bucket are spread over 2^code_bits, so gaps average about 2^code_bits / bucket_size */
+{
+    unsigned int size_bits = 64 - __builtin_clzll(bucket_size);
+    return code_bits > size_bits ? code_bits - size_bits : 0;
+}
+
+void run_parallel(uint64_t num_tasks, const std::function<void(uint64_t)> &task)
+/* Run task(i) for every i < num_tasks on up to SCAN_THREADS threads, each taking the next i when done */
+{
+    uint64_t num_threads = std::min<uint64_t>(num_scan_threads(), num_tasks);
+    if (num_threads <= 1) {
+        for (uint64_t i = 0; i < num_tasks; i++) {
+            task(i);
+        }
+        return;
+    }
+    std::atomic<uint64_t> next(0);
+    std::vector<std::thread> threads;
+    for (uint64_t t = 0; t < num_threads; t++) {
+        threads.emplace_back([&]() {
+            for (uint64_t i = next++; i < num_tasks; i = next++) {
+                task(i);
+            }
+        });
+    }
+    for (std::thread &thread : threads) {
+        thread.join();
+    }
+}
+
+
 Hash::Hash(int boardsize)
 {
     initialize(boardsize, boardsize);
@@ -18,18 +100,120 @@ Hash::Hash(int height, int width)
 
 Hash::~Hash()
 {
+    close_table();
     free_buckets();
-    delete[] m_hashtable;
+    for (Layer &layer : m_layers) {
+        munmap(layer.table, layer.layout.capacity * SLOT_SIZE);
+    }
     std::free(m_poly_terms);
 }
 
+void Hash::map_directory(Layer &layer)
+/* Reserve the directory as anonymous memory. The kernel hands out zeroed pages
+ * on first touch, so startup is instant and RSS grows with the slots in use. */
+{
+    size_t length = layer.layout.capacity * SLOT_SIZE;
+    void* ptr = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (ptr == MAP_FAILED) {
+        std::cerr << "Abort: failed to reserve the hash directory!\n";
+        exit(0);
+    }
+#ifdef MADV_HUGEPAGE
+    if (HUGE_PAGES == true) {
+        madvise(ptr, length, MADV_HUGEPAGE);
+    }
+#endif
+    layer.table = (unsigned char*) ptr;
+    layer.occupancy.assign((layer.layout.capacity + REGION_SLOTS - 1) >> REGION_BITS, 0);
+    layer.grow_size = layer.layout.idx_bits < layer.max_layout.idx_bits ? layer.layout.capacity * GROW_LOAD
+                                                                         : (uint64_t) -1;
+}
+
+Layout Hash::initial_layout(const Layout &max_layout)
+/* With GROW_DIRECTORY, a directory of INITIAL_IDX_BITS index bits, or the largest one otherwise */
+{
+    if (GROW_DIRECTORY == false || max_layout.idx_bits <= INITIAL_IDX_BITS) {
+        return max_layout;
+    }
+    unsigned int total_bits = max_layout.idx_bits + max_layout.code_bits;
+    unsigned int idx_bits = std::max(INITIAL_IDX_BITS, Layout::min_idx_bits(total_bits));
+    return Layout(idx_bits, total_bits - idx_bits);
+}
+
+void Hash::reset_directory(Layer &layer, Layout layout)
+/* Replace an empty directory by one of another layout */
+{
+    assert(layer.size == 0);
+    munmap(layer.table, layer.layout.capacity * SLOT_SIZE);
+    layer.layout = layout;
+    map_directory(layer);
+}
+
 void Hash::initialize(int height, int width)
 {
-    std::cerr << "initializing hash table\n";
-    std::memset(m_hashtable, 0, CAPACITY * sizeof(Bucket));
     m_boardsize[0] = height;
     m_boardsize[1] = width;
     m_num_points = height * width;
+    if (RANKED_KEYS == true && m_num_points > 32) {
+        std::cerr << "Abort: ranked hashcodes of a board with " << m_num_points << " points exceed 64 bits!\n";
+        exit(0);
+    }
+    m_binomials.assign(m_num_points + 1, std::vector<uint64_t>(m_num_points + 1, 0));
+    for (int i = 0; i <= m_num_points; i++) {
+        m_binomials[i][0] = 1;
+        for (int j = 1; j <= i; j++) {
+            m_binomials[i][j] = m_binomials[i-1][j-1] + m_binomials[i-1][j];
+        }
+    }
+    m_rank_offsets.assign(m_num_points + 2, 0);
+    for (int k = 0; RANKED_KEYS == true && k <= m_num_points; k++) {
+        m_rank_offsets[k+1] = m_rank_offsets[k] + num_ranks(k);
+    }
+
+    if (LAYERED_TABLE == false) {
+        m_layers.assign(1, Layer());
+        m_layers[0].max_layout = RANKED_KEYS ? Layout::for_codes(m_rank_offsets[m_num_points+1], DIRECTORY_BUDGET)
+                                             : Layout::for_board(m_num_points);
+    }
+    else {
+        if (m_num_points > 36) {
+            std::cerr << "Abort: layered hashcodes of a board with " << m_num_points << " points exceed 64 bits!\n";
+            exit(0);
+        }
+        // the budget is shared in proportion to the positions with k stones:
+        // their number of ranks, or C(n,k) 2^k among the 3^n base-3 codes
+        uint64_t num_codes = 1;
+        for (int i = 0; i < m_num_points; i++) {
+            num_codes *= 3;
+        }
+        m_layers.assign(m_num_points + 1, Layer());
+        for (int k = 0; k <= m_num_points; k++) {
+            double share = RANKED_KEYS ? (double) num_ranks(k) / m_rank_offsets[m_num_points+1]
+                                       : (double) m_binomials[m_num_points][k] * ((uint64_t) 1 << k) / num_codes;
+            uint64_t budget = (uint64_t) (DIRECTORY_BUDGET * share);
+            m_layers[k].max_layout = Layout::for_codes(RANKED_KEYS ? num_ranks(k) : num_codes, budget);
+        }
+    }
+
+    uint64_t file_offset = 0;
+    Layout largest = m_layers[0].max_layout;
+    for (Layer &layer : m_layers) {
+        layer.file_offset = file_offset;
+        file_offset += layer.max_layout.capacity;
+        layer.layout = initial_layout(layer.max_layout);
+        map_directory(layer);
+        if (layer.layout.idx_bits > largest.idx_bits) {
+            largest = layer.layout;
+        }
+    }
+    std::cerr << "initializing hash table: ";
+    if (LAYERED_TABLE == true) {
+        std::cerr << m_layers.size() << " layers, up to ";
+    }
+    std::cerr << largest.idx_bits << " index bits, " << largest.code_bits << " code bits\n";
+
+    m_front_cache.resize((uint64_t) 1 << FRONT_CACHE_BITS);
+    clear_front_cache();
     m_poly_terms = (uint64_t*) std::malloc(m_num_points * sizeof(uint64_t));
     m_poly_terms[0] = 1;
     for (int i = 1; i < m_num_points; i++) {
@@ -39,188 +223,659 @@ void Hash::initialize(int height, int width)
 
 void Hash::free_buckets()
 {
-    if (typeid(manager) == typeid(CustomMemoryManager)) {
-        return;
+    free_buckets(-1);
+}
+
+void Hash::free_buckets(int stones)
+/* Of all layers, or of one */
+{
+    if (typeid(m_manager) == typeid(CustomMemoryManager)) {
+        return;     // nothing to free: skip the scan over the whole directory
     }
-    for (uint64_t i = 0; i < CAPACITY; i++) {
-        if (m_hashtable[i] != 0) {
-            std::free(m_hashtable[i]);
+    std::vector<ScanRange> ranges = scan_ranges(stones);
+    run_parallel(ranges.size(), [&](uint64_t r) {
+        Layer &layer = m_layers[ranges[r].stones];
+        for (uint64_t i = ranges[r].begin; i < ranges[r].end; i++) {
+            if (skip_region(layer, i)) {
+                continue;
+            }
+            Slot slot = read_slot(layer, i);
+            if (slot != 0 && SlotUtil::is_inline(slot) == false) {
+                m_manager.free(SlotUtil::to_bucket(layer.layout, m_manager, slot), 0);  // size matters only to the pool
+            }
+        }
+    });
+}
+
+std::vector<ScanRange> Hash::scan_ranges(int stones)
+/* The directories of all non-empty layers, or of one, cut into ranges of whole regions */
+{
+    std::vector<ScanRange> ranges;
+    for (int k = 0; k < (int) m_layers.size(); k++) {
+        if ((stones != -1 && k != stones) || m_layers[k].size == 0) {
+            continue;
         }
+        uint64_t capacity = m_layers[k].layout.capacity;
+        for (uint64_t begin = 0; begin < capacity; begin += SCAN_RANGE_SLOTS) {
+            ranges.push_back({k, begin, std::min(begin + SCAN_RANGE_SLOTS, capacity)});
+        }
+    }
+    return ranges;
+}
+
+bool Hash::skip_region(const Layer &layer, uint64_t &idx)
+/* At the first slot of a region that was never written to, move idx to its last slot */
+{
+    if ((idx & (REGION_SLOTS - 1)) != 0 || layer.occupancy[idx >> REGION_BITS] != 0) {
+        return false;
     }
+    idx |= REGION_SLOTS - 1;
+    return true;
 }
 
 void Hash::change_boardsize(int height, int width)
+/* A new board size comes with new layouts and thus new directories */
 {
-    free_buckets();
+    clear();
+    for (Layer &layer : m_layers) {
+        munmap(layer.table, layer.layout.capacity * SLOT_SIZE);
+    }
     std::free(m_poly_terms);
     initialize(height, width);
 }
 
+void Hash::grow(Layer &layer)
+/* Double the directory. The top code bit becomes the lowest index bit, so the bucket
+ * at idx splits into the slots 2*idx and 2*idx+1, both in sorted order already. */
+{
+    Layout old_layout = layer.layout;
+    unsigned char* old_table = layer.table;
+    std::vector<unsigned char> old_occupancy = layer.occupancy;
+    layer.layout = Layout(old_layout.idx_bits + 1, old_layout.code_bits - 1);
+    map_directory(layer);
+
+    std::vector<Entry> halves[2];
+    for (uint64_t idx = 0; idx < old_layout.capacity; idx++) {
+        if ((idx & (REGION_SLOTS - 1)) == 0 && old_occupancy[idx >> REGION_BITS] == 0) {
+            idx |= REGION_SLOTS - 1;
+            continue;
+        }
+        Slot slot = 0;
+        std::memcpy(&slot, old_table + idx*SLOT_SIZE, SLOT_SIZE);
+        if (slot == 0) {
+            continue;
+        }
+        halves[0].clear();
+        halves[1].clear();
+        for (Entry entry : SlotUtil::entries(old_layout, m_manager, slot)) {
+            int top_bit = (entry >> layer.layout.code_bits) & 1;
+            halves[top_bit].push_back(layer.layout.narrow(old_layout, entry));
+        }
+        if (SlotUtil::is_inline(slot) == false) {
+            Bucket bucket = SlotUtil::to_bucket(old_layout, m_manager, slot);
+            m_manager.free(bucket, BucketUtil::bytes(old_layout, BucketUtil::capacity(old_layout, bucket)));
+        }
+        write_entries(layer, 2*idx, halves[0]);
+        write_entries(layer, 2*idx + 1, halves[1]);
+    }
+    munmap(old_table, old_layout.capacity * SLOT_SIZE);
+}
+
 void Hash::clear()
 {
-    free_buckets();
-    std::memset(m_hashtable, 0, CAPACITY * sizeof(Bucket));
+    close_table();
+    for (int stones = 0; stones < (int) m_layers.size(); stones++) {
+        clear_layer(stones);
+    }
+    m_manager.release_arena();  // no bucket points into it anymore
+}
+
+void Hash::clear_layer(int stones)
+/* Drop all buckets of a layer. The directory pages are handed back to the kernel,
+ * which refills them with zeros when they are touched again. A grown directory
+ * starts over from its initial layout. */
+{
+    Layer &layer = m_layers[stones];
+    free_buckets(stones);
+    clear_front_cache();
+    layer.size = 0;
+    layer.proof_size = 0;
+    Layout layout = initial_layout(layer.max_layout);
+    if (layout.idx_bits != layer.layout.idx_bits) {
+        reset_directory(layer, layout);
+        return;
+    }
+    madvise(layer.table, layer.layout.capacity * SLOT_SIZE, MADV_DONTNEED);
+    std::fill(layer.occupancy.begin(), layer.occupancy.end(), 0);
+}
+
+Layer& Hash::layer_of(uint64_t hashcode)
+{
+    return m_layers[LAYERED_TABLE ? hashcode >> LAYER_SHIFT : 0];
 }
 
 uint64_t Hash::hash_func(Grid &board2d)
+/* Ranked hashcodes are bitboards: black stones in the low m_num_points bits, white stones above */
 {
     uint64_t hashcode = 0;
+    uint64_t stones = 0;
     int height = (int) board2d.size();
     int width = (int) board2d[0].size();
+    int canonical_point = 0;    // the rows of board2d run from top to bottom
     for (int r = height-1; r >= 0; r--) {
         for (int c = 0; c < width; c++) {
-            hashcode = hashcode * 3 + board2d[r][c];
+            int color = board2d[r][c];
+            if (RANKED_KEYS == true && color != EMPTY) {
+                hashcode |= (uint64_t) 1 << (canonical_point + (color == WHITE) * m_num_points);
+            }
+            else if (RANKED_KEYS == false) {
+                hashcode = hashcode * 3 + color;
+            }
+            stones += color != EMPTY;
+            canonical_point++;
         }
     }
+    if (LAYERED_TABLE == true && RANKED_KEYS == false) {
+        hashcode |= stones << LAYER_SHIFT;
+    }
     return hashcode;
 }
 
 uint64_t Hash::hash_func(uint64_t hashcode, int point, int color)
 {
     int canonical_point = GoBoardUtil::point_to_canonical_point(point, m_boardsize);
+    if (RANKED_KEYS == true) {
+        return hashcode | (uint64_t) 1 << (canonical_point + (color == WHITE) * m_num_points);
+    }
     int exponent = m_num_points - 1 - canonical_point;
+    if (LAYERED_TABLE == true) {
+        hashcode += (uint64_t) 1 << LAYER_SHIFT;    // one more stone
+    }
     return hashcode + color * m_poly_terms[exponent];
 }
 
 uint64_t Hash::linear_congruence_func(uint64_t hashcode)
+/* Ranked hashcodes are ranked first. The stone count of layered hashcodes
+ * is kept above the mixed code. */
+{
+    if (RANKED_KEYS == true) {
+        uint64_t stones = __builtin_popcountll(hashcode);
+        hashcode = LAYERED_TABLE ? (stones << LAYER_SHIFT) | rank(hashcode)
+                                 : m_rank_offsets[stones] + rank(hashcode);
+    }
+    uint64_t lcg_mask = layer_of(hashcode).layout.lcg_mask;
+    return (hashcode & ~lcg_mask) | ((LCG_A * hashcode) & lcg_mask);     // mod 2^(idx_bits + code_bits)
+}
+
+void Hash::colors_of(uint64_t hashcode, std::vector<int> &colors)
+/* Inverse of hash_func(board2d): the color of each canonical point of a hashcode */
+{
+    colors.assign(m_num_points, EMPTY);
+    if (RANKED_KEYS == true) {
+        for (int p = 0; p < m_num_points; p++) {
+            colors[p] = (hashcode >> p) & 1 ? BLACK : ((hashcode >> (p + m_num_points)) & 1 ? WHITE : EMPTY);
+        }
+        return;
+    }
+    if (LAYERED_TABLE == true) {
+        hashcode &= ((uint64_t) 1 << LAYER_SHIFT) - 1;
+    }
+    for (int p = m_num_points - 1; p >= 0; p--) {
+        colors[p] = hashcode % 3;
+        hashcode /= 3;
+    }
+}
+
+uint64_t Hash::rank(uint64_t hashcode)
+/* Dense rank of a position among the positions with as many stones, whose numbers of
+ * black and white stones differ by at most one: the colex rank of the occupied points,
+ * times the number of such colorings, plus the rank of the coloring. A coloring is ranked
+ * by the colex rank of the black stones among the occupied points, after the colorings
+ * with fewer black stones. */
+{
+    uint64_t black = hashcode & (((uint64_t) 1 << m_num_points) - 1);
+    uint64_t occupied = black | (hashcode >> m_num_points);
+    uint64_t occupied_rank = 0;
+    uint64_t black_rank = 0;
+    int stones = 0;
+    int black_stones = 0;
+    for (uint64_t points = occupied; points != 0; points &= points - 1) {
+        int point = __builtin_ctzll(points);
+        uint64_t is_black = (black >> point) & 1;     // half the stones: masked rather than branched on
+        occupied_rank += m_binomials[point][stones + 1];
+        black_stones += is_black;
+        black_rank += m_binomials[stones][black_stones] & (0 - is_black);
+        stones++;
+    }
+    int white_stones = stones - black_stones;
+    assert(black_stones - white_stones <= 1 && white_stones - black_stones <= 1);
+
+    uint64_t half = m_binomials[stones][stones/2];
+    uint64_t colorings = stones % 2 == 0 ? half : 2 * half;
+    uint64_t coloring_rank = black_rank + (black_stones > white_stones ? half : 0);
+    return occupied_rank * colorings + coloring_rank;
+}
+
+uint64_t Hash::num_ranks(int stones)
 {
-    return (LCG_A * hashcode) % LCG_M;
+    uint64_t half = m_binomials[stones][stones/2];
+    return m_binomials[m_num_points][stones] * (stones % 2 == 0 ? half : 2 * half);
 }
 
-Entry Hash::format_entry_insert(Entry code, int value)
+Entry Hash::format_entry_insert(const Layout &layout, Entry code, int value)
 {
     Entry entry = code;
-    entry |= static_cast<Entry>(value) << CODE_BITS;
+    entry |= static_cast<Entry>(value) << layout.code_bits;
     return entry;
 }
 
-int Hash::format_entry_get(Entry entry)
+int Hash::format_entry_get(const Layout &layout, Entry entry)
 {
-    return static_cast<int>((entry & VALUE_MASK) >> CODE_BITS);
+    return static_cast<int>((entry & layout.value_mask) >> layout.code_bits);
 }
 
 bool Hash::insert(uint64_t hashcode, int value)
 {
-    uint64_t idx = hashcode >> CODE_BITS;
-    Entry code = hashcode & CODE_MASK;
+    Layer &layer = layer_of(hashcode);
+    const Layout &layout = layer.layout;
+    uint64_t idx = (hashcode & layout.lcg_mask) >> layout.code_bits;
+    Entry code = hashcode & layout.code_mask;
 
-    Entry entry = format_entry_insert(code, value);
-    if (m_hashtable[idx] != 0) {
-        m_hashtable[idx] = BucketUtil::insert(m_hashtable[idx], entry);
+    Entry entry = format_entry_insert(layout, code, value);
+    Slot slot = read_slot(layer, idx);
+    if (slot == 0 && layout.inline_capacity > 0) {
+        slot = SlotUtil::initialize(layout, entry);
+    }
+    else if (slot != 0 && SlotUtil::is_inline(slot)) {
+        slot = SlotUtil::insert(layout, m_manager, slot, entry);
     }
     else {
-        m_hashtable[idx] = BucketUtil::initialize(entry);
+        Bucket bucket = slot == 0 ? BucketUtil::allocate(layout, m_manager, 1)
+                                  : SlotUtil::to_bucket(layout, m_manager, slot);
+        bucket = BucketUtil::insert(layout, m_manager, bucket, entry);
+        slot = SlotUtil::from_bucket(layout, m_manager, bucket);
+    }
+    write_slot(layer, idx, slot);
+    front_line(hashcode) = {hashcode, value};
+    layer.size++;
+    if (layer.size > layer.grow_size) {
+        grow(layer);
     }
-    m_size++;
     return true;
 }
 
 int Hash::get(uint64_t hashcode)
 {
-    uint64_t idx = hashcode >> CODE_BITS;
-    Entry code = hashcode & CODE_MASK;
+    FrontLine &line = front_line(hashcode);
+    if (line.hashcode == hashcode && line.value != -1) {
+        return line.value;
+    }
+
+    Layer &layer = layer_of(hashcode);
+    uint64_t idx = (hashcode & layer.layout.lcg_mask) >> layer.layout.code_bits;
+    Entry code = hashcode & layer.layout.code_mask;
+
+    int value = m_frozen ? layer.frozen.get(hashcode & layer.layout.lcg_mask)
+                         : get_from_slot(layer.layout, read_slot(layer, idx), code);
+    if (value != -1) {
+        line = {hashcode, value};
+    }
+    return value;
+}
+
+void Hash::get_many(std::vector<uint64_t> &hashcodes, std::vector<int> &values)
+/* get() for a batch of hashcodes. All directory slots are prefetched first, then all
+ * buckets, so the cache misses of the lookups overlap instead of following one another. */
+{
+    uint64_t n = hashcodes.size();
+    values.resize(n);
+    m_batch_slots.resize(n);
+    if (m_frozen == true) {
+        for (uint64_t i = 0; i < n; i++) {
+            values[i] = get(hashcodes[i]);
+        }
+        return;
+    }
+
+    // hits in the front cache skip the table
+    for (uint64_t i = 0; i < n; i++) {
+        FrontLine &line = front_line(hashcodes[i]);
+        values[i] = line.hashcode == hashcodes[i] ? line.value : -1;
+        if (values[i] == -1) {
+            Layer &layer = layer_of(hashcodes[i]);
+            uint64_t idx = (hashcodes[i] & layer.layout.lcg_mask) >> layer.layout.code_bits;
+            __builtin_prefetch(layer.table + idx*SLOT_SIZE);
+        }
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (values[i] != -1) {
+            continue;
+        }
+        Layer &layer = layer_of(hashcodes[i]);
+        Slot slot = read_slot(layer, (hashcodes[i] & layer.layout.lcg_mask) >> layer.layout.code_bits);
+        m_batch_slots[i] = slot;
+        if (slot != 0 && SlotUtil::is_inline(slot) == false) {
+            __builtin_prefetch(bucket_of(layer.layout, slot));
+        }
+    }
+    for (uint64_t i = 0; i < n; i++) {
+        if (values[i] != -1) {
+            continue;
+        }
+        const Layout &layout = layer_of(hashcodes[i]).layout;
+        values[i] = get_from_slot(layout, m_batch_slots[i], hashcodes[i] & layout.code_mask);
+        if (values[i] != -1) {
+            front_line(hashcodes[i]) = {hashcodes[i], values[i]};
+        }
+    }
+}
+
+int Hash::peek(uint64_t hashcode)
+/* get() without the front cache: several threads may peek at once, as long as none writes the table */
+{
+    Layer &layer = layer_of(hashcode);
+    if (m_frozen == true) {
+        return layer.frozen.get(hashcode & layer.layout.lcg_mask);
+    }
+    uint64_t idx = (hashcode & layer.layout.lcg_mask) >> layer.layout.code_bits;
+    return get_from_slot(layer.layout, read_slot(layer, idx), hashcode & layer.layout.code_mask);
+}
+
+FrontLine& Hash::front_line(uint64_t hashcode)
+/* The line a hashcode maps to. Low bits of LCG outputs are weak, so the line
+ * is taken from the top bits of a multiplicative hash instead. */
+{
+    return m_front_cache[(hashcode * 0x9E3779B97F4A7C15) >> (64 - FRONT_CACHE_BITS)];
+}
+
+void Hash::clear_front_cache()
+{
+    for (FrontLine &line : m_front_cache) {
+        line = {0, -1};
+    }
+}
 
-    if (m_hashtable[idx] == 0) {
+int Hash::get_from_slot(const Layout &layout, Slot slot, Entry code)
+/* Tables of MIN_CODE_BITS-bit codes, the usual ones, are probed through their FixedLayout */
+{
+    if (slot == 0) {
         return -1;
     }
 
-    std::array<Entry, 2> t = BucketUtil::get(m_hashtable[idx], code);   // (entry, found)
+    Bucket bucket = SlotUtil::is_inline(slot) ? 0 : bucket_of(layout, slot);
+    std::array<Entry, 2> t = CommonLayout::matches(layout) ? probe(CommonLayout(), slot, bucket, code)
+                                                           : probe(layout, slot, bucket, code);   // (entry, found)
     if (t[1] == 0) {
         return -1;
     }
     
-    return format_entry_get(t[0]);
+    return format_entry_get(layout, t[0]);
 }
 
 bool Hash::set_proof_bit(uint64_t hashcode)
 /* Return true if the proof bit is changed (to 1); false, otherwise. */
 {
-    uint64_t idx = hashcode >> CODE_BITS;
-    Entry code = hashcode & CODE_MASK;
-
-    bool change_bit = BucketUtil::set_proof_bit(m_hashtable[idx], code);
-    m_proof_size += change_bit;
+    Layer &layer = layer_of(hashcode);
+    bool change_bit = write_proof_bit(layer, hashcode);
+    layer.proof_size += change_bit;
     return change_bit;
 }
 
+uint64_t Hash::set_proof_bits(std::vector<uint64_t> &hashcodes)
+/* set_proof_bit() for a batch of hashcodes, in parallel. Sorted, the hashcodes of one slot are
+ * next to each other; the batch is cut between slots, so no two threads write one slot or bucket.
+ * Return the number of proof bits changed. */
+{
+    std::sort(hashcodes.begin(), hashcodes.end());
+    uint64_t n = hashcodes.size();
+    uint64_t num_tasks = (n + PROOF_BATCH - 1) / PROOF_BATCH;
+    std::vector<uint64_t> bounds(num_tasks + 1, n);
+    bounds[0] = 0;
+    for (uint64_t t = 1; t < num_tasks; t++) {
+        uint64_t i = std::max(t * PROOF_BATCH, bounds[t - 1]);
+        while (i < n && (hashcodes[i] >> layer_of(hashcodes[i]).layout.code_bits)
+                        == (hashcodes[i - 1] >> layer_of(hashcodes[i - 1]).layout.code_bits)) {
+            i++;
+        }
+        bounds[t] = i;
+    }
+    std::vector<unsigned char> changed(n, 0);
+    run_parallel(num_tasks, [&](uint64_t t) {
+        for (uint64_t i = bounds[t]; i < bounds[t + 1]; i++) {
+            changed[i] = write_proof_bit(layer_of(hashcodes[i]), hashcodes[i]);
+        }
+    });
+    uint64_t num_changed = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        layer_of(hashcodes[i]).proof_size += changed[i];
+        num_changed += changed[i];
+    }
+    return num_changed;
+}
+
 bool Hash::get_proof_bit(uint64_t hashcode)
 /* Return true if proof bit is 1. Otherwise, return 0 */
 {
-    uint64_t idx = hashcode >> CODE_BITS;
-    Entry code = hashcode & CODE_MASK;
+    if (m_frozen == true) {
+        return false;   // frozen layers keep values only
+    }
+    Layer &layer = layer_of(hashcode);
+    const Layout &layout = layer.layout;
+    uint64_t idx = (hashcode & layout.lcg_mask) >> layout.code_bits;
+    Entry code = hashcode & layout.code_mask;
 
-    return BucketUtil::get_proof_bit(m_hashtable[idx], code);
+    Slot slot = read_slot(layer, idx);
+    if (SlotUtil::is_inline(slot)) {
+        return SlotUtil::get_proof_bit(layout, slot, code);
+    }
+    return BucketUtil::get_proof_bit(layout, bucket_of(layout, slot), code);
 }
 
 Entry Hash::get_raw(uint64_t hashcode)
 {
-    uint64_t idx = hashcode >> CODE_BITS;
-    Entry code = hashcode & CODE_MASK;
+    Layer &layer = layer_of(hashcode);
+    const Layout &layout = layer.layout;
+    uint64_t idx = (hashcode & layout.lcg_mask) >> layout.code_bits;
+    Entry code = hashcode & layout.code_mask;
 
-    std::array<Entry, 2> t = BucketUtil::get(m_hashtable[idx], code);   // (entry, found)
+    Slot slot = read_slot(layer, idx);
+    std::array<Entry, 2> t;     // (entry, found)
+    if (SlotUtil::is_inline(slot)) {
+        t = SlotUtil::get(layout, slot, code);
+    }
+    else {
+        t = BucketUtil::get(layout, bucket_of(layout, slot), code);
+    }
 
     return t[0];
 }
 
+Bucket Hash::bucket_of(const Layout &layout, Slot slot)
+/* The bucket of a slot, in the memory manager or in the mapped table */
+{
+    if (m_mapped_file != 0) {
+        return SlotUtil::to_bucket(m_mapped_file, slot);
+    }
+    return SlotUtil::to_bucket(layout, m_manager, slot);
+}
+
+bool Hash::write_proof_bit(Layer &layer, uint64_t hashcode)
+/* set_proof_bit() without counting it in the layer */
+{
+    const Layout &layout = layer.layout;
+    uint64_t idx = (hashcode & layout.lcg_mask) >> layout.code_bits;
+    Entry code = hashcode & layout.code_mask;
+
+    Slot slot = read_slot(layer, idx);
+    if (SlotUtil::is_inline(slot)) {
+        bool change_bit = SlotUtil::set_proof_bit(layout, slot, code);
+        write_slot(layer, idx, slot);
+        return change_bit;
+    }
+    return BucketUtil::set_proof_bit(layout, SlotUtil::to_bucket(layout, m_manager, slot), code);
+}
+
+Slot Hash::read_slot(const Layer &layer, uint64_t idx)
+{
+    Slot slot = 0;
+    std::memcpy(&slot, layer.table + idx*SLOT_SIZE, SLOT_SIZE);
+    return slot;
+}
+
+void Hash::write_slot(Layer &layer, uint64_t idx, Slot slot)
+{
+    std::memcpy(layer.table + idx*SLOT_SIZE, &slot, SLOT_SIZE);
+    if (slot != 0 && layer.occupancy[idx >> REGION_BITS] == 0) {  // set_proof_bits writes slots in parallel
+        layer.occupancy[idx >> REGION_BITS] = 1;
+    }
+}
+
 uint64_t Hash::size()
 {
-    return m_size;
+    uint64_t size = 0;
+    for (Layer &layer : m_layers) {
+        size += layer.size;
+    }
+    return size;
 }
 
 uint64_t Hash::proof_size()
 {
-    return m_proof_size;
+    uint64_t proof_size = 0;
+    for (Layer &layer : m_layers) {
+        proof_size += layer.proof_size;
+    }
+    return proof_size;
 }
 
 void Hash::clear_proof_bit()
 {
-    Entry mask = -1;
-    mask ^= PROOF_MASK;
-    for (uint64_t i = 0; i < CAPACITY; i++) {
-        if (m_hashtable[i] != 0) {
-            Bucket bucket_load = m_hashtable[i] + ENTRY_SIZE;
-            uint64_t bucket_size = BucketUtil::read_entry(m_hashtable[i], 0);
-            for (uint64_t j = 0; j < bucket_size; j++) {
-                Entry entry = BucketUtil::read_entry(bucket_load, j);
-                entry &= mask;
-                BucketUtil::write_entry(bucket_load, j, entry);
+    for (Layer &layer : m_layers) {
+        layer.proof_size = 0;
+    }
+    std::vector<ScanRange> ranges = scan_ranges();
+    run_parallel(ranges.size(), [&](uint64_t r) {
+        Layer &layer = m_layers[ranges[r].stones];
+        const Layout &layout = layer.layout;
+        Entry mask = -1;
+        mask ^= layout.proof_mask;
+        for (uint64_t i = ranges[r].begin; i < ranges[r].end; i++) {
+            if (skip_region(layer, i)) {
+                continue;
+            }
+            Slot slot = read_slot(layer, i);
+            if (slot == 0) {
+                continue;
+            }
+            if (SlotUtil::is_inline(slot)) {
+                for (uint64_t j = 0; j < SlotUtil::size(slot); j++) {
+                    slot = SlotUtil::write_entry(layout, slot, j, SlotUtil::read_entry(layout, slot, j) & mask);
+                }
+                write_slot(layer, i, slot);
+            }
+            else {
+                Bucket bucket = SlotUtil::to_bucket(layout, m_manager, slot);
+                Bucket bucket_load = BucketUtil::load(layout, bucket);
+                uint64_t bucket_size = BucketUtil::size(layout, bucket);
+                for (uint64_t j = 0; j < bucket_size; j++) {
+                    Entry entry = BucketUtil::read_entry(layout, bucket_load, j);
+                    entry &= mask;
+                    BucketUtil::write_entry(layout, bucket_load, j, entry);
+                }
+            }
+        }
+    });
+}
+
+uint64_t Hash::collect_garbage()
+/* Compact every bucket to the entries with the proof bit, and with GC_KEEP_RECENT
+ * to the entries still in the front cache. Return the number of entries dropped.
+ * Ranges are compacted in parallel; ranges hold whole regions, so no two threads write one,
+ * and the pool of a CustomMemoryManager is taken by one thread at a time. */
+{
+    std::vector<ScanRange> ranges = scan_ranges();
+    std::vector<uint64_t> dropped(ranges.size(), 0);
+    std::mutex pool_mutex;
+    run_parallel(ranges.size(), [&](uint64_t r) {
+        int stones = ranges[r].stones;
+        Layer &layer = m_layers[stones];
+        const Layout &layout = layer.layout;
+        uint64_t layer_bits = LAYERED_TABLE ? (uint64_t) stones << LAYER_SHIFT : 0;
+        std::vector<Entry> kept;
+        for (uint64_t idx = ranges[r].begin; idx < ranges[r].end; idx++) {
+            if (skip_region(layer, idx)) {
+                continue;
+            }
+            Slot slot = read_slot(layer, idx);
+            if (slot == 0) {
+                continue;
             }
+            std::vector<Entry> entries = read_entries(layer, idx);
+            kept.clear();
+            for (Entry entry : entries) {
+                bool keep = (entry & layout.proof_mask) != 0;
+                if (keep == false && GC_KEEP_RECENT == true) {
+                    uint64_t hashcode = layer_bits | (idx << layout.code_bits) | (entry & layout.code_mask);
+                    FrontLine &line = front_line(hashcode);
+                    keep = line.hashcode == hashcode && line.value != -1;
+                }
+                if (keep == true) {
+                    kept.push_back(entry);
+                }
+            }
+            if (kept.size() == entries.size()) {
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(pool_mutex, std::defer_lock);
+            if (typeid(m_manager) == typeid(CustomMemoryManager)) {
+                lock.lock();
+            }
+            if (SlotUtil::is_inline(slot) == false) {
+                Bucket bucket = SlotUtil::to_bucket(layout, m_manager, slot);
+                m_manager.free(bucket, BucketUtil::bytes(layout, BucketUtil::capacity(layout, bucket)));
+            }
+            write_slot(layer, idx, 0);
+            write_entries(layer, idx, kept);
+            dropped[r] += entries.size() - kept.size();
         }
+    });
+    uint64_t num_dropped = 0;
+    for (uint64_t r = 0; r < ranges.size(); r++) {
+        m_layers[ranges[r].stones].size -= dropped[r];
+        num_dropped += dropped[r];
     }
+    if (GC_KEEP_RECENT == false) {
+        clear_front_cache();    // its lines may name dropped entries
+    }
+#if defined(__GLIBC__)
+    malloc_trim(0);     // hand the freed buckets back to the system
+#endif
+    return num_dropped;
 }
 
 std::string Hash::store(std::string file_name, bool proof_only)
+/* Solution file, version SOLUTION_VERSION: a header with the board size, the LCG and the layout
+ * of each layer, followed by one block per range of slots with non-empty buckets.
+ * Buckets are written in the max_layout of their layer, however far the directory has grown,
+ * and layers follow one another in the index space of the file.
+ * Batches of ranges are encoded in parallel, then appended in order. */
 {
     std::ofstream f;
     f.open(file_name, std::ios::binary);
+    std::string header = solution_header();
+    f.write(header.data(), header.size());
 
-    for (uint64_t idx = 0; idx < CAPACITY; idx++) {
-        if (m_hashtable[idx] != 0) {
-            Bucket bucket_load = m_hashtable[idx] + ENTRY_SIZE;
-            uint64_t bucket_size = BucketUtil::read_entry(m_hashtable[idx], 0);
-            if (proof_only == false) {
-                f.write((const char*)(&idx), sizeof(uint64_t));
-                f.write((const char*)(&bucket_size), ENTRY_SIZE);
-                f.write((const char*)bucket_load, bucket_size*ENTRY_SIZE);
-            }
-            else {
-                uint64_t proof_count = 0;
-                Bucket tmp_bucket = (Bucket) std::malloc(bucket_size*ENTRY_SIZE);
-                for (uint64_t i = 0; i < bucket_size; i++) {
-                    Entry entry = BucketUtil::read_entry(bucket_load, i);
-                    bool proved = (entry & PROOF_MASK) != 0;
-                    if (proved == true) {
-                        BucketUtil::write_entry(tmp_bucket, proof_count, entry);
-                        proof_count++;
-                    }
-                }
-                if (proof_count > 0) {
-                    f.write((const char*)(&idx), sizeof(uint64_t));
-                    f.write((const char*)(&proof_count), ENTRY_SIZE);
-                    f.write((const char*)tmp_bucket, proof_count*ENTRY_SIZE);
-                }
-                std::free(tmp_bucket);
-            }
+    std::vector<ScanRange> ranges = scan_ranges();
+    uint64_t batch_size = 4 * num_scan_threads();
+    std::vector<std::string> shards(batch_size);
+    for (uint64_t first = 0; first < ranges.size(); first += batch_size) {
+        uint64_t num_shards = std::min(batch_size, ranges.size() - first);
+        run_parallel(num_shards, [&](uint64_t i) {
+            shards[i].clear();
+            store_range(ranges[first + i], proof_only, shards[i]);
+        });
+        for (uint64_t i = 0; i < num_shards; i++) {
+            f.write(shards[i].data(), shards[i].size());
         }
     }
 
@@ -229,155 +884,1422 @@ std::string Hash::store(std::string file_name, bool proof_only)
     return file_name;
 }
 
+std::string Hash::solution_header(const char* magic)
+/* Magic and version, height and width, flags (bit 0: layered, bit 1: ranked), LCG_A,
+ * number of layers, then index bits and code bits of each layer: 4 bytes each, LCG_A 8 bytes */
+{
+    std::string header(magic, 4);
+    uint32_t fields[] = {SOLUTION_VERSION, (uint32_t) m_boardsize[0], (uint32_t) m_boardsize[1],
+                         (uint32_t) LAYERED_TABLE | (uint32_t) RANKED_KEYS << 1};
+    header.append((const char*) fields, sizeof(fields));
+    header.append((const char*) &LCG_A, sizeof(uint64_t));
+    uint32_t num_layers = m_layers.size();
+    header.append((const char*) &num_layers, sizeof(uint32_t));
+    for (Layer &layer : m_layers) {
+        uint32_t bits[] = {layer.max_layout.idx_bits, layer.max_layout.code_bits};
+        header.append((const char*) bits, sizeof(bits));
+    }
+    return header;
+}
+
+void Hash::store_range(const ScanRange &range, bool proof_only, std::string &shard)
+/* Block: its length in bytes, the file index its deltas start from, its numbers of buckets
+ * and of entries, 8 bytes each, then a bit stream. For each bucket, the gap to the previous
+ * index and the size in Elias gamma code, then for each entry the gap to the previous code
+ * in Rice code, its value bit and its proof bit. Empty ranges have no block. */
+{
+    Layer &layer = m_layers[range.stones];
+    const Layout &layout = layer.layout;
+    const Layout &file_layout = layer.max_layout;
+    unsigned int split_bits = file_layout.idx_bits - layout.idx_bits;
+    uint64_t split_mask = ((uint64_t) 1 << split_bits) - 1;
+
+    std::string stream;
+    BitWriter writer(stream);
+    uint64_t base = layer.file_offset + (range.begin << split_bits);
+    uint64_t last_idx = base - 1;
+    uint64_t num_buckets = 0;
+    uint64_t num_entries = 0;
+    for (uint64_t idx = range.begin; idx < range.end; idx++) {
+        if (skip_region(layer, idx) || read_slot(layer, idx) == 0) {
+            continue;
+        }
+        std::vector<Entry> entries = read_entries(layer, idx);
+        if (proof_only == true) {
+            uint64_t proof_count = 0;
+            for (Entry entry : entries) {
+                bool proved = (entry & layout.proof_mask) != 0;
+                if (proved == true) {
+                    entries[proof_count] = entry;
+                    proof_count++;
+                }
+            }
+            entries.resize(proof_count);
+        }
+        // sorted by code, so the entries of each file bucket are consecutive
+        for (uint64_t i = 0; i < entries.size(); ) {
+            uint64_t split = (entries[i] >> file_layout.code_bits) & split_mask;
+            uint64_t j = i;
+            while (j < entries.size() && ((entries[j] >> file_layout.code_bits) & split_mask) == split) {
+                j++;
+            }
+            uint64_t file_idx = layer.file_offset + ((idx << split_bits) | split);
+            uint64_t bucket_size = j - i;
+            writer.write_gamma(file_idx - last_idx);
+            writer.write_gamma(bucket_size);
+            last_idx = file_idx;
+            num_buckets++;
+            num_entries += bucket_size;
+
+            unsigned int k = rice_parameter(file_layout.code_bits, bucket_size);
+            Entry last_code = (Entry) -1;
+            for (; i < j; i++) {
+                Entry entry = file_layout.narrow(layout, entries[i]);
+                Entry code = entry & file_layout.code_mask;
+                writer.write_rice(code - last_code - 1, k);
+                writer.write(entry >> file_layout.code_bits, 2);
+                last_code = code;
+            }
+        }
+    }
+    if (num_buckets == 0) {
+        return;
+    }
+    writer.flush();
+    uint64_t fields[] = {stream.size(), base, num_buckets, num_entries};
+    shard.append((const char*) fields, sizeof(fields));
+    shard.append(stream);
+}
+
 std::string Hash::load(std::string file_name)
+/* The file is mapped and its blocks are decoded in parallel, twice: once to size a single
+ * arena for all buckets, once to fill it. Blocks cover disjoint ranges of whole regions. */
 {
-    std::ifstream f;
-    f.open(file_name, std::ios::binary);
-    if (not f) {
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
         std::cerr << "Failed to load solution from " << file_name << "\n";
         return "";
     }
-    clear();
-
-    f.seekg(0, f.end);
-    uint64_t length = f.tellg();
-    f.seekg(0, f.beg);
+    uint64_t length = file_stat.st_size;
+    std::string header = solution_header();
+    const unsigned char* data = length == 0 ? 0 : (const unsigned char*) mmap(0, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Abort: failed to map " << file_name << "!\n";
+        exit(0);
+    }
+    if (length < header.size() || std::memcmp(data, header.data(), header.size()) != 0) {
+        std::cerr << "Failed to load solution from " << file_name << ": not a version " << SOLUTION_VERSION
+                  << " solution of this board size and table layout\n";
+        if (length > 0) {
+            munmap((void*) data, length);
+        }
+        return "";
+    }
 
-    uint64_t num_byte_read = 0;
+    madvise((void*) data, length, MADV_WILLNEED);
 
-    while (num_byte_read < length)
+    // blocks: a header of 4 fields and a stream of its length, with increasing bases, each
+    // below the file index the next one starts from, so they fill disjoint slots
+    std::vector<uint64_t> blocks;
+    std::vector<uint64_t> bases;
+    uint64_t num_byte_read = header.size();
+    bool valid = true;
+    while (valid == true && num_byte_read < length)
     {
-        uint64_t idx = 0, bucket_size = 0;
-        f.read((char*)(&idx), sizeof(uint64_t));
-        f.read((char*)(&bucket_size), ENTRY_SIZE);
-        m_hashtable[idx] = (Bucket) manager.malloc((bucket_size+1)*ENTRY_SIZE);
-        BucketUtil::write_entry(m_hashtable[idx], 0, bucket_size);
-        Bucket bucket_load = m_hashtable[idx] + ENTRY_SIZE;
-        f.read((char*)bucket_load, bucket_size*ENTRY_SIZE);
+        uint64_t fields[4];     // stream size, base, num buckets, num entries
+        if (length - num_byte_read < sizeof(fields)) {
+            valid = false;
+            break;
+        }
+        std::memcpy(fields, data + num_byte_read, sizeof(fields));
+        valid = fields[0] <= length - num_byte_read - sizeof(fields)
+                && fields[1] < file_slots() && (bases.empty() || fields[1] > bases.back());
+        blocks.push_back(num_byte_read);
+        bases.push_back(fields[1]);
+        num_byte_read += sizeof(fields) + fields[0];
+    }
+    bases.push_back(file_slots());
 
-        m_size += bucket_size;
+    // first pass: check every block, and size its bucket memory, so all buckets fit into one arena
+    std::vector<uint64_t> block_offsets(blocks.size() + 1, 0);
+    std::vector<unsigned char> block_valid(blocks.size(), 0);
+    if (valid == true) {
+        run_parallel(blocks.size(), [&](uint64_t b) {
+            block_valid[b] = load_block(data + blocks[b], bases[b + 1], 0, 0, block_offsets[b + 1]);
+        });
+        valid = std::find(block_valid.begin(), block_valid.end(), 0) == block_valid.end();
+    }
+    if (valid == false) {
+        std::cerr << "Failed to load solution from " << file_name << ": corrupt block\n";
+        munmap((void*) data, length);
+        return "";
+    }
+    for (uint64_t b = 0; b < blocks.size(); b++) {
+        block_offsets[b + 1] += block_offsets[b];
+    }
 
-        num_byte_read += sizeof(uint64_t) + (bucket_size+1)*ENTRY_SIZE;
+    clear();
+    for (Layer &layer : m_layers) {
+        if (layer.layout.idx_bits != layer.max_layout.idx_bits) {
+            reset_directory(layer, layer.max_layout);   // the layout of the file
+        }
     }
-    assert(num_byte_read == length);
+    unsigned char* arena = block_offsets.back() == 0 ? 0 : (unsigned char*) m_manager.arena(block_offsets.back());
 
-    f.close();
-    clear_proof_bit();
+    // second pass: fill the directory and the arena, without proof bits
+    std::vector<uint64_t> block_sizes(blocks.size() * m_layers.size(), 0);
+    run_parallel(blocks.size(), [&](uint64_t b) {
+        uint64_t num_bytes;
+        load_block(data + blocks[b], bases[b + 1], arena + block_offsets[b], &block_sizes[b * m_layers.size()],
+                   num_bytes);
+    });
+    for (uint64_t b = 0; b < blocks.size(); b++) {
+        for (uint64_t k = 0; k < m_layers.size(); k++) {
+            m_layers[k].size += block_sizes[b*m_layers.size() + k];
+        }
+    }
+
+    munmap((void*) data, length);
     return file_name;
 }
 
-/****************************************************************/
-/****************************************************************/
-/****************************************************************/
-
-Bucket BucketUtil::initialize()
+bool Hash::load_block(const unsigned char* block, uint64_t end_idx, unsigned char* memory, uint64_t* layer_sizes,
+                      uint64_t &num_bytes)
+/* Decode one block of a solution file, and count in num_bytes the bytes of its buckets that
+ * do not fit inline. Without layer_sizes, nothing is written. Otherwise the buckets are placed
+ * one after another into memory, proof bits are dropped, and the entries of each layer are
+ * counted. Return false if the block is corrupt: a bucket outside [base, end_idx) or the
+ * directory of its layer, larger than a bucket can be, or with a code beyond the code bits,
+ * or a stream that ends early or disagrees with the numbers of buckets and entries. */
 {
-    Bucket bucket = (Bucket) manager.malloc(ENTRY_SIZE);
-    write_entry(bucket, 0, 0);
-    return bucket;
+    uint64_t fields[4];     // stream size, base, num buckets, num entries
+    std::memcpy(fields, block, sizeof(fields));
+    BitReader reader(block + sizeof(fields), fields[0]);
+    uint64_t last_idx = fields[1] - 1;
+    uint64_t num_entries = 0;
+    num_bytes = 0;
+    std::vector<Entry> entries;
+    for (uint64_t n = 0; n < fields[2]; n++) {
+        uint64_t gap = reader.read_gamma();
+        uint64_t bucket_size = reader.read_gamma();
+        if (reader.corrupt() || gap > end_idx - 1 - last_idx) {    // last_idx < end_idx, or base - 1
+            return false;
+        }
+        uint64_t idx = last_idx + gap;
+        last_idx = idx;
+        int stones = file_layer(idx);
+        Layer &layer = m_layers[stones];
+        const Layout &layout = layer.max_layout;
+        if (idx - layer.file_offset >= layout.capacity || bucket_size > layout.max_bucket_size) {
+            return false;
+        }
+
+        unsigned int k = rice_parameter(layout.code_bits, bucket_size);
+        Entry last_code = (Entry) -1;
+        entries.resize(bucket_size);
+        for (uint64_t i = 0; i < bucket_size; i++) {
+            Entry gap = reader.read_rice(k);
+            if (reader.corrupt() || last_code + 1 > layout.code_mask || gap > layout.code_mask - (last_code + 1)) {
+                return false;
+            }
+            Entry code = last_code + 1 + gap;
+            entries[i] = code | (reader.read(2) & 1) << layout.code_bits;
+            last_code = code;
+        }
+        num_entries += bucket_size;
+        unsigned char* bucket_memory = 0;
+        if (bucket_size > layout.inline_capacity) {
+            bucket_memory = memory == 0 ? 0 : memory + num_bytes;
+            num_bytes += BucketUtil::bytes(layout, bucket_size);
+        }
+        if (layer_sizes != 0) {
+            write_entries(layer, idx - layer.file_offset, entries, bucket_memory);
+            layer_sizes[stones] += bucket_size;
+        }
+    }
+    return reader.corrupt() == false && num_entries == fields[3];
 }
 
-Bucket BucketUtil::initialize(Entry entry)
+uint64_t Hash::file_slots()
+/* Number of slots of all layers in solution files */
 {
-    Bucket bucket = (Bucket) manager.malloc(2*ENTRY_SIZE);
-    write_entry(bucket, 0, 1);
-    write_entry(bucket, 1, entry);
+    return m_layers.back().file_offset + m_layers.back().max_layout.capacity;
+}
+
+std::string Hash::table_header()
+/* The header of solution files, then the slot size and whether entries are packed,
+ * since both shape the directories and buckets of the file */
+{
+    std::string header = solution_header(TABLE_MAGIC);
+    uint32_t fields[] = {(uint32_t) SLOT_SIZE, (uint32_t) PACK_ENTRIES};
+    header.append((const char*) fields, sizeof(fields));
+    return header;
+}
+
+std::string Hash::store_table(std::string file_name)
+/* Table file: the header, a record per layer (index bits, number of entries, position of
+ * its directory; 8 bytes each), then per layer its directory followed by its buckets,
+ * exactly as they are laid out in memory. Only proved entries are kept, without their
+ * proof bit. Each directory is the smallest one that holds at most GROW_LOAD entries
+ * per slot on average, and slots of buckets hold their position in the file. */
+{
+    std::ofstream f;
+    f.open(file_name, std::ios::binary);
+    std::string header = table_header();
+    std::vector<uint64_t> records(3 * m_layers.size(), 0);
+    f.write(header.data(), header.size());
+    f.write((const char*) records.data(), records.size() * sizeof(uint64_t));
+    uint64_t pos = header.size() + records.size() * sizeof(uint64_t);
+
+    for (uint64_t k = 0; k < m_layers.size(); k++) {
+        Layer &layer = m_layers[k];
+        const Layout &layout = layer.layout;
+        std::vector<ScanRange> ranges = scan_ranges(k);
+        uint64_t num_entries = count_entries(k, true);
+
+        unsigned int total_bits = layout.idx_bits + layout.code_bits;
+        unsigned int idx_bits = Layout::min_idx_bits(total_bits);
+        while (idx_bits < layer.max_layout.idx_bits && ((uint64_t) GROW_LOAD << idx_bits) < num_entries) {
+            idx_bits++;
+        }
+        Layout table_layout(idx_bits, total_bits - idx_bits);
+        uint64_t dir_pos = (pos + TABLE_ALIGNMENT - 1) / TABLE_ALIGNMENT * TABLE_ALIGNMENT;
+        uint64_t bucket_pos = dir_pos + (table_layout.capacity * SLOT_SIZE + 7) / 8 * 8;
+        records[3*k] = idx_bits;
+        records[3*k + 1] = num_entries;
+        records[3*k + 2] = dir_pos;
+
+        // keys come in increasing order, so the entries of each slot of the table are consecutive
+        std::vector<unsigned char> directory(table_layout.capacity * SLOT_SIZE, 0);
+        std::string buckets;
+        std::vector<Entry> entries;
+        uint64_t table_idx = 0;
+        auto write_bucket = [&]() {
+            Slot slot;
+            if (entries.size() <= table_layout.inline_capacity) {
+                slot = SlotUtil::pack(table_layout, entries);
+            }
+            else {
+                if (entries.size() > table_layout.max_bucket_size) {
+                    std::cerr << "Abort: a bucket of " << entries.size() << " entries overflows the table layout!\n";
+                    exit(0);
+                }
+                uint64_t offset = buckets.size();
+                buckets.resize(offset + BucketUtil::bytes(table_layout, entries.size()), 0);
+                Bucket bucket = BucketUtil::place(table_layout, (unsigned char*) &buckets[offset], entries.size());
+                BucketUtil::write_field(table_layout, bucket, 0, entries.size());
+                Bucket bucket_load = BucketUtil::load(table_layout, bucket);
+                for (uint64_t i = 0; i < entries.size(); i++) {
+                    BucketUtil::write_entry(table_layout, bucket_load, i, entries[i]);
+                }
+                slot = SlotUtil::from_offset(bucket_pos + offset);
+            }
+            std::memcpy(&directory[table_idx * SLOT_SIZE], &slot, SLOT_SIZE);
+            entries.clear();
+        };
+        for (const ScanRange &range : ranges) {
+            for (uint64_t idx = range.begin; idx < range.end; idx++) {
+                if (skip_region(layer, idx) || read_slot(layer, idx) == 0) {
+                    continue;
+                }
+                for (Entry entry : read_entries(layer, idx)) {
+                    if ((entry & layout.proof_mask) == 0) {
+                        continue;
+                    }
+                    uint64_t key = (idx << layout.code_bits) | (entry & layout.code_mask);
+                    if ((key >> table_layout.code_bits) != table_idx && entries.empty() == false) {
+                        write_bucket();
+                    }
+                    table_idx = key >> table_layout.code_bits;
+                    bool value = (entry & layout.value_mask) != 0;
+                    entries.push_back((key & table_layout.code_mask) | (Entry) value << table_layout.code_bits);
+                }
+            }
+        }
+        if (entries.empty() == false) {
+            write_bucket();
+        }
+
+        f.write(std::string(dir_pos - pos, 0).data(), dir_pos - pos);
+        f.write((const char*) directory.data(), directory.size());
+        f.write(std::string(bucket_pos - dir_pos - directory.size(), 0).data(), bucket_pos - dir_pos - directory.size());
+        f.write(buckets.data(), buckets.size());
+        pos = bucket_pos + buckets.size();
+    }
+
+    f.seekp(header.size());
+    f.write((const char*) records.data(), records.size() * sizeof(uint64_t));
+    f.flush();
+    f.close();
+    return file_name;
+}
+
+std::string Hash::open_table(std::string file_name)
+/* Map a file of store_table and query it in place. Only the slots are read up front, to
+ * check that their buckets lie within the file; the pages of the buckets are paged in as
+ * they are probed, and shared by all processes mapping the same file. The table is
+ * read-only until it is cleared. */
+{
+    int fd = open(file_name.c_str(), O_RDONLY);
+    struct stat file_stat;
+    if (fd == -1 || fstat(fd, &file_stat) == -1) {
+        std::cerr << "Failed to open table from " << file_name << "\n";
+        return "";
+    }
+    uint64_t length = file_stat.st_size;
+    std::string header = table_header();
+    uint64_t records_size = 3 * m_layers.size() * sizeof(uint64_t);
+    unsigned char* data = length == 0 ? 0 : (unsigned char*) mmap(0, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        std::cerr << "Abort: failed to map " << file_name << "!\n";
+        exit(0);
+    }
+
+    bool valid = length >= header.size() + records_size && std::memcmp(data, header.data(), header.size()) == 0;
+    std::vector<uint64_t> records(3 * m_layers.size(), 0);
+    for (uint64_t k = 0; valid == true && k < m_layers.size(); k++) {
+        std::memcpy(&records[3*k], data + header.size() + 3*k*sizeof(uint64_t), 3*sizeof(uint64_t));
+        const Layout &max_layout = m_layers[k].max_layout;
+        valid = records[3*k] <= max_layout.idx_bits
+                && records[3*k] >= Layout::min_idx_bits(max_layout.idx_bits + max_layout.code_bits)
+                && records[3*k + 2] <= length && ((uint64_t) SLOT_SIZE << records[3*k]) <= length - records[3*k + 2];
+    }
+    if (valid == false) {
+        std::cerr << "Failed to open table from " << file_name << ": not a version " << SOLUTION_VERSION
+                  << " table of this board size and table layout\n";
+        if (length > 0) {
+            munmap(data, length);
+        }
+        return "";
+    }
+    for (uint64_t k = 0; valid == true && k < m_layers.size(); k++) {
+        unsigned int total_bits = m_layers[k].max_layout.idx_bits + m_layers[k].max_layout.code_bits;
+        valid = mapped_directory_valid(data, length, records[3*k + 2], Layout(records[3*k], total_bits - records[3*k]));
+    }
+    if (valid == false) {
+        std::cerr << "Failed to open table from " << file_name << ": corrupt bucket\n";
+        munmap(data, length);
+        return "";
+    }
+
+    clear();
+    madvise(data, length, MADV_RANDOM);     // probes jump around, read ahead is wasted
+    for (uint64_t k = 0; k < m_layers.size(); k++) {
+        Layer &layer = m_layers[k];
+        unsigned int total_bits = layer.max_layout.idx_bits + layer.max_layout.code_bits;
+        munmap(layer.table, layer.layout.capacity * SLOT_SIZE);
+        layer.layout = Layout(records[3*k], total_bits - records[3*k]);
+        layer.table = data + records[3*k + 2];
+        layer.size = records[3*k + 1];
+        layer.occupancy.assign((layer.layout.capacity + REGION_SLOTS - 1) >> REGION_BITS, 1);
+        layer.grow_size = (uint64_t) -1;
+    }
+    m_mapped_file = data;
+    m_mapped_length = length;
+    return file_name;
+}
+
+bool Hash::mapped_directory_valid(unsigned char* data, uint64_t length, uint64_t dir_pos, const Layout &layout)
+/* Whether every slot of a directory in a mapped table holds a valid inline size, or the
+ * offset of a whole bucket within the file, so probes never read past its end */
+{
+    uint64_t num_ranges = (layout.capacity + SCAN_RANGE_SLOTS - 1) / SCAN_RANGE_SLOTS;
+    std::vector<unsigned char> range_valid(num_ranges, 0);
+    run_parallel(num_ranges, [&](uint64_t r) {
+        uint64_t end = std::min((r + 1) * SCAN_RANGE_SLOTS, layout.capacity);
+        for (uint64_t idx = r * SCAN_RANGE_SLOTS; idx < end; idx++) {
+            Slot slot = 0;
+            std::memcpy(&slot, data + dir_pos + idx*SLOT_SIZE, SLOT_SIZE);
+            if (slot == 0) {
+                continue;
+            }
+            if (SlotUtil::is_inline(slot)) {
+                if (SlotUtil::size(slot) == 0 || SlotUtil::size(slot) > layout.inline_capacity) {
+                    return;
+                }
+                continue;
+            }
+            uint64_t offset = SlotUtil::to_bucket(data, slot) - data;
+            if (offset > length || length - offset < layout.header_size) {
+                return;
+            }
+            uint64_t bucket_size = BucketUtil::size(layout, data + offset);
+            if (bucket_size == 0 || bucket_size > layout.max_bucket_size
+                || BucketUtil::bytes(layout, bucket_size) > length - offset) {
+                return;
+            }
+        }
+        range_valid[r] = 1;
+    });
+    return std::find(range_valid.begin(), range_valid.end(), 0) == range_valid.end();
+}
+
+uint64_t Hash::count_entries(int stones, bool proof_only)
+/* Entries of a layer, or only the proved ones */
+{
+    Layer &layer = m_layers[stones];
+    if (proof_only == false) {
+        return layer.size;
+    }
+    uint64_t num_entries = 0;
+    for (const ScanRange &range : scan_ranges(stones)) {
+        for (uint64_t idx = range.begin; idx < range.end; idx++) {
+            if (skip_region(layer, idx) || read_slot(layer, idx) == 0) {
+                continue;
+            }
+            for (Entry entry : read_entries(layer, idx)) {
+                num_entries += (entry & layer.layout.proof_mask) != 0;
+            }
+        }
+    }
+    return num_entries;
+}
+
+uint64_t Hash::freeze(bool proof_only)
+/* Move all entries, or only the proved ones, into frozen layers and free the table.
+ * Keys come out of the directory in increasing order, as slots are scanned in order and
+ * buckets are sorted. Return the bytes taken by the frozen layers. */
+{
+    assert(m_frozen == false && m_mapped_file == 0);
+    std::vector<FrozenLayer> frozen(m_layers.size());
+    run_parallel(m_layers.size(), [&](uint64_t k) {
+        Layer &layer = m_layers[k];
+        const Layout &layout = layer.layout;
+        frozen[k] = FrozenLayer(count_entries(k, proof_only), layout.idx_bits + layout.code_bits);
+        for (const ScanRange &range : scan_ranges(k)) {
+            for (uint64_t idx = range.begin; idx < range.end; idx++) {
+                if (skip_region(layer, idx) || read_slot(layer, idx) == 0) {
+                    continue;
+                }
+                for (Entry entry : read_entries(layer, idx)) {
+                    if (proof_only == true && (entry & layout.proof_mask) == 0) {
+                        continue;
+                    }
+                    uint64_t key = (idx << layout.code_bits) | (entry & layout.code_mask);
+                    frozen[k].push_back(key, (entry & layout.value_mask) != 0);
+                }
+            }
+        }
+        frozen[k].finish();
+    });
+
+    clear();
+    uint64_t bytes = 0;
+    for (uint64_t k = 0; k < m_layers.size(); k++) {
+        m_layers[k].frozen = std::move(frozen[k]);
+        m_layers[k].size = m_layers[k].frozen.size;
+        bytes += m_layers[k].frozen.bytes();
+    }
+    m_frozen = true;
+    return bytes;
+}
+
+void Hash::close_table()
+/* Replace a mapped or frozen table by empty directories */
+{
+    if (m_frozen == true) {
+        for (Layer &layer : m_layers) {
+            layer.frozen = FrozenLayer();
+            layer.size = 0;
+        }
+        m_frozen = false;
+        clear_front_cache();
+    }
+    if (m_mapped_file == 0) {
+        return;
+    }
+    for (Layer &layer : m_layers) {
+        layer.size = 0;
+        layer.proof_size = 0;
+        layer.layout = initial_layout(layer.max_layout);
+        map_directory(layer);
+    }
+    munmap(m_mapped_file, m_mapped_length);
+    m_mapped_file = 0;
+    m_mapped_length = 0;
+    clear_front_cache();
+}
+
+void Hash::set_strategy(std::vector<std::pair<uint64_t, int>> &moves)
+/* Replace the strategy by (hashcode, canonical point of the winning move) pairs */
+{
+    unsigned int move_bits = 1;
+    while ((1 << move_bits) < m_num_points) {
+        move_bits++;
+    }
+    std::vector<std::vector<std::pair<uint64_t, int>>> keys(m_layers.size());
+    for (std::pair<uint64_t, int> &move : moves) {
+        Layer &layer = layer_of(move.first);
+        keys[&layer - &m_layers[0]].push_back({move.first & layer.layout.lcg_mask, move.second});
+    }
+    for (uint64_t k = 0; k < m_layers.size(); k++) {
+        Layer &layer = m_layers[k];
+        std::sort(keys[k].begin(), keys[k].end());
+        layer.strategy = FrozenLayer(keys[k].size(), layer.layout.idx_bits + layer.layout.code_bits, move_bits);
+        for (std::pair<uint64_t, int> &key : keys[k]) {
+            layer.strategy.push_back(key.first, key.second);
+        }
+        layer.strategy.finish();
+    }
+}
+
+std::string Hash::store_strategy(std::string file_name)
+/* Strategy file: the header of solution files with its own magic, then per layer its
+ * winning positions as a frozen layer, whose values are the moves */
+{
+    std::string out = solution_header(STRATEGY_MAGIC);
+    for (Layer &layer : m_layers) {
+        layer.strategy.write(out);
+    }
+    std::ofstream f;
+    f.open(file_name, std::ios::binary);
+    f.write(out.data(), out.size());
+    f.close();
+    return file_name;
+}
+
+std::string Hash::load_strategy(std::string file_name)
+{
+    std::ifstream f(file_name, std::ios::binary);
+    std::string data((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
+    std::string header = solution_header(STRATEGY_MAGIC);
+    const char* pos = data.data() + header.size();
+    const char* end = data.data() + data.size();
+    std::vector<FrozenLayer> strategies(m_layers.size());
+    bool valid = f.is_open() && data.size() >= header.size() && data.compare(0, header.size(), header) == 0;
+    for (uint64_t k = 0; valid == true && k < m_layers.size(); k++) {
+        valid = strategies[k].read(pos, end);
+    }
+    if (valid == false || pos != end) {
+        std::cerr << "Failed to load strategy from " << file_name << ": not a version " << SOLUTION_VERSION
+                  << " strategy of this board size and table layout\n";
+        return "";
+    }
+    for (uint64_t k = 0; k < m_layers.size(); k++) {
+        m_layers[k].strategy = std::move(strategies[k]);
+    }
+    return file_name;
+}
+
+int Hash::strategy_move(uint64_t hashcode)
+/* Canonical point of the winning move of the strategy; -1 if the position is not in it */
+{
+    Layer &layer = layer_of(hashcode);
+    return layer.strategy.get(hashcode & layer.layout.lcg_mask);
+}
+
+int Hash::file_layer(uint64_t file_idx)
+/* The layer of an index in solution files */
+{
+    int stones = (int) m_layers.size() - 1;
+    while (m_layers[stones].file_offset > file_idx) {
+        stones--;
+    }
+    return stones;
+}
+
+std::vector<Entry> Hash::read_entries(Layer &layer, uint64_t idx)
+/* All entries of a bucket, in order */
+{
+    return SlotUtil::entries(layer.layout, m_manager, read_slot(layer, idx));
+}
+
+void Hash::write_entries(Layer &layer, uint64_t idx, std::vector<Entry> &entries, unsigned char* memory)
+/* Fill an empty slot with sorted entries, inline if they fit.
+ * Otherwise the bucket is placed at memory if given, and allocated if not */
+{
+    const Layout &layout = layer.layout;
+    assert(read_slot(layer, idx) == 0);
+    uint64_t bucket_size = entries.size();
+    if (bucket_size == 0) {
+        return;
+    }
+    if (bucket_size <= layout.inline_capacity) {
+        write_slot(layer, idx, SlotUtil::pack(layout, entries));
+    }
+    else {
+        Bucket bucket = memory != 0 ? BucketUtil::place(layout, memory, bucket_size)
+                                    : BucketUtil::allocate(layout, m_manager, bucket_size);
+        BucketUtil::write_field(layout, bucket, 0, bucket_size);
+        Bucket bucket_load = BucketUtil::load(layout, bucket);
+        for (uint64_t i = 0; i < bucket_size; i++) {
+            BucketUtil::write_entry(layout, bucket_load, i, entries[i]);
+        }
+        write_slot(layer, idx, SlotUtil::from_bucket(layout, m_manager, bucket));
+    }
+}
+
+/****************************************************************/
+/****************************************************************/
+/****************************************************************/
+
+Layout::Layout(unsigned int idx_bits, unsigned int code_bits) :
+    idx_bits(idx_bits), code_bits(code_bits)
+{
+    assert(idx_bits + code_bits <= 64 && code_bits <= MAX_CODE_BITS);
+    entry_size = (code_bits + 2 + 7) / 8;   // code, value bit and proof bit
+    entry_bits = PACK_ENTRIES ? code_bits + 2 : 8 * entry_size;
+    capacity = (uint64_t) 1 << idx_bits;
+    lcg_mask = (uint64_t) -1 >> (64 - idx_bits - code_bits);
+    code_mask = (Entry) -1 >> (8*sizeof(Entry) - code_bits);
+    value_mask = (Entry) 1 << code_bits;
+    proof_mask = (Entry) 1 << (code_bits + 1);
+    entry_mask = (Entry) -1 >> (8*sizeof(Entry) - entry_bits);
+    header_size = 2 * entry_size;
+    max_bucket_size = (uint64_t) -1 >> (64 - 8*entry_size);
+    pad_size = entry_bits % 8 == 0 ? 0 : 8 - entry_size;
+    inline_capacity = std::min<uint64_t>(7, (SLOT_BITS - SLOT_HEADER_BITS) / entry_bits);
+    lane_ones = 0;
+    for (unsigned int bit = 0; bit + entry_bits <= 64; bit += entry_bits) {
+        lane_ones |= (uint64_t) 1 << bit;
+        top_lane = bit;
+    }
+    load_lanes = (64 - 7) / entry_bits;
+}
+
+Layout Layout::for_board(int num_points, uint64_t budget)
+{
+    if (num_points > 40) {
+        std::cerr << "Abort: hashcodes of a board with " << num_points << " points exceed 64 bits!\n";
+        exit(0);
+    }
+    uint64_t num_codes = 1;     // 3^num_points
+    for (int i = 0; i < num_points; i++) {
+        num_codes *= 3;
+    }
+    return for_codes(num_codes, budget);
+}
+
+Layout Layout::for_codes(uint64_t num_codes, uint64_t budget)
+{
+    unsigned int total_bits = 1;
+    while (total_bits < 64 && ((uint64_t) 1 << total_bits) < num_codes) {
+        total_bits++;
+    }
+
+    unsigned int idx_bits = 0;
+    while (((uint64_t) SLOT_SIZE << (idx_bits+1)) <= budget) {
+        idx_bits++;
+    }
+    idx_bits = std::min(idx_bits, total_bits > MIN_CODE_BITS ? total_bits - MIN_CODE_BITS : 0);
+    idx_bits = std::max(idx_bits, min_idx_bits(total_bits));
+    return Layout(idx_bits, total_bits - idx_bits);
+}
+
+unsigned int Layout::min_idx_bits(unsigned int total_bits)
+{
+    return total_bits > MAX_CODE_BITS ? total_bits - MAX_CODE_BITS : 0;
+}
+
+Entry Layout::narrow(const Layout &from, Entry entry) const
+{
+    return (entry & code_mask) | ((entry >> from.code_bits) << code_bits);
+}
+
+/****************************************************************/
+/****************************************************************/
+/****************************************************************/
+
+Bucket BucketUtil::allocate(const Layout &layout, MemoryManager &manager, uint64_t capacity)
+/* Empty bucket with room for capacity entries */
+{
+    return place(layout, (unsigned char*) manager.malloc(bytes(layout, capacity)), capacity);
+}
+
+Bucket BucketUtil::place(const Layout &layout, unsigned char* memory, uint64_t capacity)
+/* Empty bucket in bytes(layout, capacity) bytes of memory that is already allocated */
+{
+    Bucket bucket = (Bucket) memory;
+    write_field(layout, bucket, 0, 0);
+    write_field(layout, bucket, 1, capacity);
     return bucket;
 }
 
-void BucketUtil::write_entry(Bucket bucket, uint64_t idx, Entry entry)
+template <class L>
+uint64_t BucketUtil::size(const L &layout, Bucket bucket)
+{
+    return read_field(layout, bucket, 0);
+}
+
+uint64_t BucketUtil::capacity(const Layout &layout, Bucket bucket)
 {
-    std::memcpy(bucket+idx*ENTRY_SIZE, &entry, ENTRY_SIZE);
+    return read_field(layout, bucket, 1);
 }
 
-Entry BucketUtil::read_entry(Bucket bucket, uint64_t idx)
+template <class L>
+Bucket BucketUtil::load(const L &layout, Bucket bucket)
+{
+    return bucket + layout.header_size;
+}
+
+uint64_t BucketUtil::bytes(const Layout &layout, uint64_t capacity)
+/* Rounded up to SLOT_GRANULE, so every bucket can be addressed by a slot */
+{
+    uint64_t bytes = layout.header_size + (capacity*layout.entry_bits + 7) / 8 + layout.pad_size;
+    return (bytes + SLOT_GRANULE - 1) / SLOT_GRANULE * SLOT_GRANULE;
+}
+
+uint64_t BucketUtil::grow(const Layout &layout, uint64_t capacity)
+/* Next capacity: 1, 2, 4, 7, 11, 17, 26, 40, ...
+ * so a bucket of size n has been reallocated O(log n) times */
+{
+    uint64_t new_capacity = capacity + capacity/2 + 1;
+    return std::min(new_capacity, layout.max_bucket_size);
+}
+
+void BucketUtil::write_field(const Layout &layout, Bucket bucket, uint64_t idx, uint64_t value)
+/* Header fields are entry_size bytes each */
+{
+    std::memcpy(bucket+idx*layout.entry_size, &value, layout.entry_size);
+}
+
+template <class L>
+uint64_t BucketUtil::read_field(const L &layout, Bucket bucket, uint64_t idx)
+{
+    uint64_t value = 0;
+    std::memcpy(&value, bucket+idx*layout.entry_size, layout.entry_size);
+    return value;
+}
+
+void BucketUtil::write_entry(const Layout &layout, Bucket bucket, uint64_t idx, Entry entry)
+/* Widths of 16 and 32 bits get a fixed-size copy; the layout is the same for every call.
+ * Packed entries are read and written through the 8-byte word they start in,
+ * which pad_size keeps inside the bucket. */
+{
+    if (layout.entry_bits % 8 != 0) {
+        uint64_t bit = idx * layout.entry_bits;
+        uint64_t word;
+        std::memcpy(&word, bucket + (bit >> 3), 8);
+        word &= ~(layout.entry_mask << (bit & 7));
+        word |= entry << (bit & 7);
+        std::memcpy(bucket + (bit >> 3), &word, 8);
+        return;
+    }
+    switch (layout.entry_size) {
+    case 2:
+        std::memcpy(bucket+idx*2, &entry, 2);
+        break;
+    case 4:
+        std::memcpy(bucket+idx*4, &entry, 4);
+        break;
+    default:
+        std::memcpy(bucket+idx*layout.entry_size, &entry, layout.entry_size);
+    }
+}
+
+template <class L>
+Entry BucketUtil::read_entry(const L &layout, Bucket bucket, uint64_t idx)
+/* 2- and 4-byte entries are loaded at their own width: a narrow copy into a zeroed
+ * 8-byte entry would stall on store forwarding when the entry is read back */
 {
     Entry entry = 0;
-    std::memcpy(&entry, bucket+idx*ENTRY_SIZE, ENTRY_SIZE);
+    if (layout.entry_bits % 8 != 0) {
+        uint64_t bit = idx * layout.entry_bits;
+        std::memcpy(&entry, bucket + (bit >> 3), 8);
+        return (entry >> (bit & 7)) & layout.entry_mask;
+    }
+    switch (layout.entry_size) {
+    case 2: {
+        uint16_t narrow;
+        std::memcpy(&narrow, bucket+idx*2, 2);
+        return narrow;
+    }
+    case 4: {
+        uint32_t narrow;
+        std::memcpy(&narrow, bucket+idx*4, 4);
+        return narrow;
+    }
+    default:
+        std::memcpy(&entry, bucket+idx*layout.entry_size, layout.entry_size);
+    }
     return entry;
 }
 
-Bucket BucketUtil::insert(Bucket bucket, Entry entry)
+Bucket BucketUtil::insert(const Layout &layout, MemoryManager &manager, Bucket bucket, Entry entry)
 {
-    Bucket bucket_load = bucket + ENTRY_SIZE;   // the actual array of entries inside bucket
-    uint64_t size = read_entry(bucket, 0);            // 0-th encodes the size
-    Entry code = entry & CODE_MASK;
+    Bucket bucket_load = load(layout, bucket);      // the actual array of entries inside bucket
+    uint64_t size = BucketUtil::size(layout, bucket);
+    uint64_t capacity = BucketUtil::capacity(layout, bucket);
+    Entry code = entry & layout.code_mask;
 
-    std::array<int, 2> t = binary_search(bucket_load, code, 0, size-1);    // (idx, found)
+    std::array<int, 2> t = find(layout, bucket_load, code, size);    // (idx, found)
     int idx = t[0];
     assert(t[1] == 0);
 
-    bucket = (Bucket) manager.realloc(bucket, (size+2)*ENTRY_SIZE, (size+1)*ENTRY_SIZE);  // 0-th + size + one new entry
-    assert(bucket);
-    bucket_load = bucket + ENTRY_SIZE;
+    if (size == capacity) {
+        uint64_t new_capacity = grow(layout, capacity);
+        assert(new_capacity > size);
+        bucket = (Bucket) manager.realloc(bucket, bytes(layout, new_capacity), bytes(layout, capacity));
+        assert(bucket);
+        write_field(layout, bucket, 1, new_capacity);
+        bucket_load = load(layout, bucket);
+    }
 
-    manager.memmove(bucket_load+(idx+1)*ENTRY_SIZE, bucket_load+idx*ENTRY_SIZE, (size-idx)*ENTRY_SIZE);
-    write_entry(bucket_load, idx, entry);
+    if (layout.entry_bits % 8 == 0) {
+        manager.memmove(bucket_load+(idx+1)*layout.entry_size, bucket_load+idx*layout.entry_size,
+                        (size-idx)*layout.entry_size);
+    }
+    else {
+        for (uint64_t i = size; i > (uint64_t) idx; i--) {
+            write_entry(layout, bucket_load, i, read_entry(layout, bucket_load, i-1));
+        }
+    }
+    write_entry(layout, bucket_load, idx, entry);
 
     size += 1;
-    write_entry(bucket, 0, size);   // size + 1
+    write_field(layout, bucket, 0, size);
     return bucket;
 }
 
-std::array<Entry, 2> BucketUtil::get(Bucket bucket, Entry code)
+template <class L>
+std::array<Entry, 2> BucketUtil::get(const L &layout, Bucket bucket, Entry code)
 /* Return (entry, found)
  * when size=0, this method won't be called from Hash */
 {
-    Bucket bucket_load = bucket + ENTRY_SIZE;
-    uint64_t size = read_entry(bucket, 0);
+    Bucket bucket_load = load(layout, bucket);
+    uint64_t size = BucketUtil::size(layout, bucket);
 
-    std::array<int, 2> t = binary_search(bucket_load, code, 0, size-1);    // (idx, found)
-    Entry entry = read_entry(bucket_load, t[0]*t[1]);
+    std::array<int, 2> t = find(layout, bucket_load, code, size);    // (idx, found)
+    Entry entry = read_entry(layout, bucket_load, t[0]*t[1]);
     return {entry, static_cast<Entry>(t[1])};
 }
 
-bool BucketUtil::set_proof_bit(Bucket bucket, Entry code)
+bool BucketUtil::set_proof_bit(const Layout &layout, Bucket bucket, Entry code)
 {
-    Bucket bucket_load = bucket + ENTRY_SIZE;
-    uint64_t size = read_entry(bucket, 0);
+    Bucket bucket_load = load(layout, bucket);
+    uint64_t size = BucketUtil::size(layout, bucket);
 
-    std::array<int, 2> t = binary_search(bucket_load, code, 0, size-1);    // (idx, found)
+    std::array<int, 2> t = find(layout, bucket_load, code, size);    // (idx, found)
     assert(t[1]);
     int idx = t[0] * t[1];
-    Entry entry = read_entry(bucket_load, idx);
+    Entry entry = read_entry(layout, bucket_load, idx);
 
-    bool bit_changed = (entry & PROOF_MASK) == 0;
-    entry |= PROOF_MASK;
-    write_entry(bucket_load, idx, entry);
+    bool bit_changed = (entry & layout.proof_mask) == 0;
+    entry |= layout.proof_mask;
+    write_entry(layout, bucket_load, idx, entry);
     return bit_changed;
 }
 
-bool BucketUtil::get_proof_bit(Bucket bucket, Entry code)
+bool BucketUtil::get_proof_bit(const Layout &layout, Bucket bucket, Entry code)
 {
-    Bucket bucket_load = bucket + ENTRY_SIZE;
-    uint64_t size = read_entry(bucket, 0);
+    Bucket bucket_load = load(layout, bucket);
+    uint64_t size = BucketUtil::size(layout, bucket);
 
-    std::array<int, 2> t = binary_search(bucket_load, code, 0, size-1);    // (idx, found)
+    std::array<int, 2> t = find(layout, bucket_load, code, size);    // (idx, found)
     assert(t[1]);
-    Entry entry = read_entry(bucket_load, t[0]);
-    bool proved = (entry & PROOF_MASK) != 0;
+    Entry entry = read_entry(layout, bucket_load, t[0]);
+    bool proved = (entry & layout.proof_mask) != 0;
     return proved;
 }
 
-std::array<int, 2> BucketUtil::binary_search(Bucket bucket_load, Entry code, int low, int high)
+template <class L>
+std::array<int, 2> BucketUtil::find(const L &layout, Bucket bucket_load, Entry code, uint64_t size)
 /* Return <idx, found>.
  * If found==0, idx is the idx to insert.
- * If found==1, idx is the real idx of the entry. */
+ * If found==1, idx is the real idx of the entry.
+ * Long buckets are first narrowed down by a branchless binary search,
+ * the remaining window is then scanned linearly (with SIMD if possible). */
+{
+    uint64_t low = 0, n = size;
+    while (n > SCAN_THRESHOLD) {
+        uint64_t half = n / 2;
+        bool right = (read_entry(layout, bucket_load, low+half) & layout.code_mask) < code;
+        low += right * half;    // no branch: compiles to cmov
+        n -= half;
+    }
+
+    uint64_t idx = low + count_less(layout, bucket_load, code, low, low+n);
+    bool found = idx < size && (read_entry(layout, bucket_load, idx) & layout.code_mask) == code;
+    return {static_cast<int>(idx), found};
+}
+
+template <class L>
+uint64_t BucketUtil::count_less(const L &layout, Bucket bucket_load, Entry code, uint64_t low, uint64_t high)
+/* Return the number of entries in [low, high) whose code is smaller than code.
+ * With 2-byte entries codes are below 2^14, so signed 16-bit comparisons are safe.
+ * Packed entries are compared a word at a time, 4 entries of 12 bits for 10-bit codes. */
+{
+    uint64_t count = 0;
+    uint64_t i = low;
+    if (layout.entry_bits == 16) {
+        // lanes that compare less are -1, so subtracting them counts per lane; summed once at the end
+#if defined(__SSE2__)
+        __m128i counts = _mm_setzero_si128();
+#endif
+#if defined(__AVX2__)
+        const __m256i mask = _mm256_set1_epi16(static_cast<short>(layout.code_mask));
+        const __m256i target = _mm256_set1_epi16(static_cast<short>(code));
+        __m256i counts_256 = _mm256_setzero_si256();
+        for (; i + 16 <= high; i += 16) {
+            __m256i chunk = _mm256_loadu_si256((const __m256i*)(bucket_load + i*2));
+            counts_256 = _mm256_sub_epi16(counts_256, _mm256_cmpgt_epi16(target, _mm256_and_si256(chunk, mask)));
+        }
+        counts = _mm_add_epi16(_mm256_castsi256_si128(counts_256), _mm256_extracti128_si256(counts_256, 1));
+#endif
+#if defined(__SSE2__)
+        const __m128i mask_128 = _mm_set1_epi16(static_cast<short>(layout.code_mask));
+        const __m128i target_128 = _mm_set1_epi16(static_cast<short>(code));
+        for (; i + 8 <= high; i += 8) {
+            __m128i chunk = _mm_loadu_si128((const __m128i*)(bucket_load + i*2));
+            counts = _mm_sub_epi16(counts, _mm_cmplt_epi16(_mm_and_si128(chunk, mask_128), target_128));
+        }
+        __m128i sums = _mm_madd_epi16(counts, _mm_set1_epi16(1));
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0x4E));
+        sums = _mm_add_epi32(sums, _mm_shuffle_epi32(sums, 0xB1));
+        count += _mm_cvtsi128_si32(sums);
+#endif
+    }
+    else if (layout.entry_bits % 8 != 0) {
+        if (code == 0) {
+            return 0;
+        }
+        // load_lanes entries per 8-byte load from the byte of entry i
+        for (; i < high; i += layout.load_lanes) {
+            uint64_t bit = i * layout.entry_bits;
+            uint64_t word;
+            std::memcpy(&word, bucket_load + (bit >> 3), 8);
+            count += count_less_lanes(layout, word >> (bit & 7), code, std::min(layout.load_lanes, high - i));
+        }
+    }
+    for (; i < high; i++) {
+        count += (read_entry(layout, bucket_load, i) & layout.code_mask) < code;
+    }
+    return count;
+}
+
+/****************************************************************/
+/****************************************************************/
+/****************************************************************/
+
+bool SlotUtil::is_inline(Slot slot)
+{
+    return (slot & 1) != 0;
+}
+
+Bucket SlotUtil::to_bucket(const Layout &layout, MemoryManager &manager, Slot slot)
+{
+    return to_bucket(manager.base(), slot);
+}
+
+Bucket SlotUtil::to_bucket(unsigned char* base, Slot slot)
+{
+    return base + ((slot >> 1) - 1) * SLOT_GRANULE;
+}
+
+Slot SlotUtil::from_bucket(const Layout &layout, MemoryManager &manager, Bucket bucket)
+{
+    return from_offset(reinterpret_cast<uintptr_t>(bucket) - reinterpret_cast<uintptr_t>(manager.base()));
+}
+
+Slot SlotUtil::from_offset(uint64_t offset)
+/* Offsets are stored plus one, so a bucket at the very start of the pool is not an empty slot */
+{
+    assert(offset % SLOT_GRANULE == 0);
+    offset = offset / SLOT_GRANULE + 1;
+    if (SLOT_SIZE < sizeof(Slot) && (offset >> (SLOT_BITS - 1)) != 0) {
+        std::cerr << "Abort: bucket offset does not fit into a " << SLOT_SIZE << "-byte slot!\n";
+        exit(0);
+    }
+    return offset << 1;
+}
+
+Slot SlotUtil::initialize(const Layout &layout, Entry entry)
+{
+    return write_entry(layout, (1 << 1) | 1, 0, entry);
+}
+
+uint64_t SlotUtil::size(Slot slot)
+{
+    return (slot >> 1) & 7;
+}
+
+template <class L>
+Entry SlotUtil::read_entry(const L &layout, Slot slot, uint64_t idx)
+{
+    return (slot >> (SLOT_HEADER_BITS + idx*layout.entry_bits)) & layout.entry_mask;
+}
+
+Slot SlotUtil::write_entry(const Layout &layout, Slot slot, uint64_t idx, Entry entry)
+{
+    uint64_t shift = SLOT_HEADER_BITS + idx*layout.entry_bits;
+    slot &= ~(layout.entry_mask << shift);
+    return slot | (entry << shift);
+}
+
+Slot SlotUtil::insert(const Layout &layout, MemoryManager &manager, Slot slot, Entry entry)
+/* Insert into an inline slot; a full slot spills into a heap bucket */
 {
-    if (low > high) {
-        return {low, 0};    // not inside bucket
+    uint64_t size = SlotUtil::size(slot);
+    Entry code = entry & layout.code_mask;
+
+    std::array<int, 2> t = find(layout, slot, code);    // (idx, found)
+    uint64_t idx = t[0];
+    assert(t[1] == 0);
+
+    if (size == layout.inline_capacity) {
+        Bucket bucket = BucketUtil::allocate(layout, manager, BucketUtil::grow(layout, size));
+        BucketUtil::write_field(layout, bucket, 0, size);
+        unpack(layout, slot, BucketUtil::load(layout, bucket));
+        return from_bucket(layout, manager, BucketUtil::insert(layout, manager, bucket, entry));
+    }
+
+    for (uint64_t i = size; i > idx; i--) {
+        slot = write_entry(layout, slot, i, read_entry(layout, slot, i-1));
+    }
+    slot = write_entry(layout, slot, idx, entry);
+    slot = (slot & ~((Slot) 7 << 1)) | ((size+1) << 1);
+    return slot;
+}
+
+template <class L>
+std::array<Entry, 2> SlotUtil::get(const L &layout, Slot slot, Entry code)
+/* Return (entry, found) */
+{
+    std::array<int, 2> t = find(layout, slot, code);    // (idx, found)
+    Entry entry = read_entry(layout, slot, t[0]*t[1]);
+    return {entry, static_cast<Entry>(t[1])};
+}
+
+bool SlotUtil::set_proof_bit(const Layout &layout, Slot &slot, Entry code)
+{
+    std::array<int, 2> t = find(layout, slot, code);    // (idx, found)
+    assert(t[1]);
+    Entry entry = read_entry(layout, slot, t[0]);
+
+    bool bit_changed = (entry & layout.proof_mask) == 0;
+    slot = write_entry(layout, slot, t[0], entry | layout.proof_mask);
+    return bit_changed;
+}
+
+bool SlotUtil::get_proof_bit(const Layout &layout, Slot slot, Entry code)
+{
+    std::array<int, 2> t = find(layout, slot, code);    // (idx, found)
+    assert(t[1]);
+    return (read_entry(layout, slot, t[0]) & layout.proof_mask) != 0;
+}
+
+template <class L>
+std::array<int, 2> SlotUtil::find(const L &layout, Slot slot, Entry code)
+/* Return <idx, found>, as BucketUtil::find */
+{
+    uint64_t size = SlotUtil::size(slot);
+    uint64_t idx = code == 0 ? 0 : count_less_lanes(layout, slot >> SLOT_HEADER_BITS, code, size);
+    bool found = idx < size && (read_entry(layout, slot, idx) & layout.code_mask) == code;
+    return {static_cast<int>(idx), found};
+}
+
+void SlotUtil::unpack(const Layout &layout, Slot slot, Bucket bucket_load)
+/* Copy the entries of an inline slot into an array of entries */
+{
+    for (uint64_t i = 0; i < size(slot); i++) {
+        BucketUtil::write_entry(layout, bucket_load, i, read_entry(layout, slot, i));
+    }
+}
+
+std::vector<Entry> SlotUtil::entries(const Layout &layout, MemoryManager &manager, Slot slot)
+{
+    std::vector<Entry> entries;
+    if (slot == 0) {
+        return entries;
+    }
+    if (is_inline(slot)) {
+        for (uint64_t i = 0; i < size(slot); i++) {
+            entries.push_back(read_entry(layout, slot, i));
+        }
     }
     else {
-        int mid = (low + high) / 2;
-        Entry entry_code = read_entry(bucket_load, mid) & CODE_MASK;
-        if (code == entry_code) {
-            return {mid, 1};
+        Bucket bucket = to_bucket(layout, manager, slot);
+        Bucket bucket_load = BucketUtil::load(layout, bucket);
+        uint64_t bucket_size = BucketUtil::size(layout, bucket);
+        for (uint64_t i = 0; i < bucket_size; i++) {
+            entries.push_back(BucketUtil::read_entry(layout, bucket_load, i));
         }
-        else if (code > entry_code) {
-            return binary_search(bucket_load, code, mid+1, high);
+    }
+    return entries;
+}
+
+Slot SlotUtil::pack(const Layout &layout, std::vector<Entry> &entries)
+{
+    uint64_t size = entries.size();
+    assert(0 < size && size <= layout.inline_capacity);
+    Slot slot = (size << 1) | 1;
+    for (uint64_t i = 0; i < size; i++) {
+        slot = write_entry(layout, slot, i, entries[i]);
+    }
+    return slot;
+}
+
+/****************************************************************/
+/****************************************************************/
+/****************************************************************/
+
+FrozenLayer::FrozenLayer(uint64_t num_keys, unsigned int key_bits, unsigned int value_bits)
+/* About key_bits - log2(num_keys) low bits and at most 3 high bits per key */
+    : value_bits(value_bits)
+{
+    low_bits = rice_parameter(key_bits, std::max<uint64_t>(num_keys, 1));
+    uint64_t num_highs = num_keys + ((uint64_t) 1 << (key_bits - low_bits));
+    lows.assign((num_keys * low_bits + 63) / 64 + 1, 0);
+    highs.assign((num_highs + 63) / 64 + 1, 0);     // zeros past the end stop select_zero
+    values.assign((num_keys * value_bits + 63) / 64 + 1, 0);
+}
+
+void FrozenLayer::push_back(uint64_t key, uint64_t value)
+{
+    write_bits(lows, size * low_bits, low_bits, key & (((uint64_t) 1 << low_bits) - 1));
+    write_bits(values, size * value_bits, value_bits, value);
+    uint64_t pos = (key >> low_bits) + size;
+    highs[pos / 64] |= (uint64_t) 1 << (pos % 64);
+    size++;
+}
+
+void FrozenLayer::finish()
+/* Sample the position of every FROZEN_SAMPLE-th zero of highs */
+{
+    zero_samples.clear();
+    uint64_t num_zeros = 0;
+    for (uint64_t w = 0; w < highs.size(); w++) {
+        uint64_t zeros = ~highs[w];
+        uint64_t count = __builtin_popcountll(zeros);
+        while (zero_samples.size() * FROZEN_SAMPLE < num_zeros + count) {
+            uint64_t word = zeros;
+            for (uint64_t skip = zero_samples.size() * FROZEN_SAMPLE - num_zeros; skip > 0; skip--) {
+                word &= word - 1;
+            }
+            zero_samples.push_back(w * 64 + __builtin_ctzll(word));
         }
-        else {
-            return binary_search(bucket_load, code, low, mid-1);
+        num_zeros += count;
+    }
+}
+
+int FrozenLayer::get(uint64_t key) const
+{
+    int64_t i = find(key);
+    return i == -1 ? -1 : (int) read_bits(values, i * value_bits, value_bits);
+}
+
+int64_t FrozenLayer::find(uint64_t key) const
+/* Index of a key, or -1: scan the keys of the same high part, in increasing order of their low bits */
+{
+    if (zero_samples.empty()) {
+        return -1;      // never built
+    }
+    uint64_t high = key >> low_bits;
+    uint64_t low = key & (((uint64_t) 1 << low_bits) - 1);
+    uint64_t pos = high == 0 ? 0 : select_zero(high - 1) + 1;
+    for (uint64_t i = pos - high; ((highs[pos / 64] >> (pos % 64)) & 1) != 0; pos++, i++) {
+        uint64_t key_low = read_bits(lows, i * low_bits, low_bits);
+        if (key_low >= low) {
+            return key_low == low ? i : -1;
         }
     }
+    return -1;
+}
+
+uint64_t FrozenLayer::bytes() const
+{
+    return (lows.size() + highs.size() + values.size() + zero_samples.size()) * sizeof(uint64_t);
+}
+
+void FrozenLayer::write(std::string &out) const
+/* Number of keys, low and value bits, the lengths of lows, highs, values and zero samples, then their words */
+{
+    uint64_t fields[] = {size, low_bits, value_bits, lows.size(), highs.size(), values.size(), zero_samples.size()};
+    out.append((const char*) fields, sizeof(fields));
+    for (const std::vector<uint64_t>* words : {&lows, &highs, &values, &zero_samples}) {
+        out.append((const char*) words->data(), words->size() * sizeof(uint64_t));
+    }
+}
+
+bool FrozenLayer::read(const char* &pos, const char* end)
+/* Return false if the words run past end */
+{
+    uint64_t fields[7];
+    if (end - pos < (int64_t) sizeof(fields)) {
+        return false;
+    }
+    std::memcpy(fields, pos, sizeof(fields));
+    pos += sizeof(fields);
+    size = fields[0];
+    low_bits = fields[1];
+    value_bits = fields[2];
+    uint64_t num_words = fields[3] + fields[4] + fields[5] + fields[6];
+    if (low_bits >= 64 || value_bits > 32 || fields[3] < (size * low_bits + 63) / 64 + 1
+        || fields[5] < (size * value_bits + 63) / 64 + 1 || fields[6] == 0
+        || (uint64_t) (end - pos) / sizeof(uint64_t) < num_words) {
+        return false;
+    }
+    uint64_t k = 3;
+    for (std::vector<uint64_t>* words : {&lows, &highs, &values, &zero_samples}) {
+        words->resize(fields[k]);
+        std::memcpy(words->data(), pos, fields[k] * sizeof(uint64_t));
+        pos += fields[k] * sizeof(uint64_t);
+        k++;
+    }
+    return true;
+}
+
+void FrozenLayer::write_bits(std::vector<uint64_t> &words, uint64_t bit, unsigned int n, uint64_t x)
+/* Or the n lowest bits of x into words, starting at bit; words has one word of slack */
+{
+    if (n == 0) {
+        return;
+    }
+    words[bit / 64] |= x << (bit % 64);
+    if (bit % 64 + n > 64) {
+        words[bit / 64 + 1] |= x >> (64 - bit % 64);
+    }
+}
+
+uint64_t FrozenLayer::read_bits(const std::vector<uint64_t> &words, uint64_t bit, unsigned int n)
+{
+    if (n == 0) {
+        return 0;
+    }
+    uint64_t x = words[bit / 64] >> (bit % 64);
+    if (bit % 64 + n > 64) {
+        x |= words[bit / 64 + 1] << (64 - bit % 64);
+    }
+    return x & (((uint64_t) 1 << n) - 1);
+}
+
+uint64_t FrozenLayer::select_zero(uint64_t rank) const
+/* Position of the zero of highs with this rank, counted from 0: from the nearest sample,
+ * skip whole words by their number of zeros, then zeros within the last word */
+{
+    uint64_t pos = zero_samples[rank / FROZEN_SAMPLE];
+    uint64_t skip = rank % FROZEN_SAMPLE;
+    uint64_t w = pos / 64;
+    uint64_t zeros = ~highs[w] & ((uint64_t) -1 << (pos % 64));
+    uint64_t count = __builtin_popcountll(zeros);
+    while (skip >= count) {
+        skip -= count;
+        w++;
+        zeros = ~highs[w];
+        count = __builtin_popcountll(zeros);
+    }
+    for (; skip > 0; skip--) {
+        zeros &= zeros - 1;
+    }
+    return w * 64 + __builtin_ctzll(zeros);
+}
+
+/****************************************************************/
+/****************************************************************/
+/****************************************************************/
+
+void BitWriter::write(uint64_t value, unsigned int num_bits)
+{
+    while (num_bits > 0) {
+        unsigned int chunk = std::min(num_bits, 32u);
+        m_buffer |= (value & (((uint64_t) 1 << chunk) - 1)) << m_num_bits;
+        m_num_bits += chunk;
+        value >>= chunk;
+        num_bits -= chunk;
+        while (m_num_bits >= 8) {
+            m_bytes.push_back((char) (m_buffer & 0xFF));
+            m_buffer >>= 8;
+            m_num_bits -= 8;
+        }
+    }
+}
+
+void BitWriter::write_unary(uint64_t value)
+/* value zeros, then a one */
+{
+    for (; value >= 32; value -= 32) {
+        write(0, 32);
+    }
+    write((uint64_t) 1 << value, value + 1);
+}
+
+void BitWriter::write_gamma(uint64_t value)
+/* value >= 1: the number of bits after the leading one in unary, then those bits */
+{
+    assert(value >= 1);
+    unsigned int num_bits = 63 - __builtin_clzll(value);
+    write_unary(num_bits);
+    write(value, num_bits);
+}
+
+void BitWriter::write_rice(uint64_t value, unsigned int k)
+{
+    write_unary(value >> k);
+    write(value, k);
+}
+
+void BitWriter::flush()
+/* Pad the last byte with zeros */
+{
+    if (m_num_bits > 0) {
+        m_bytes.push_back((char) (m_buffer & 0xFF));
+    }
+    m_buffer = 0;
+    m_num_bits = 0;
+}
+
+void BitReader::refill()
+{
+    while (m_num_bits <= 56 && m_pos < m_end) {
+        m_buffer |= (uint64_t) *m_pos << m_num_bits;
+        m_pos++;
+        m_num_bits += 8;
+    }
+}
+
+uint64_t BitReader::read(unsigned int num_bits)
+{
+    uint64_t value = 0;
+    for (unsigned int shift = 0; shift < num_bits; ) {
+        refill();
+        unsigned int chunk = std::min(num_bits - shift, 32u);
+        m_corrupt |= m_num_bits < chunk;
+        value |= (m_buffer & (((uint64_t) 1 << chunk) - 1)) << shift;
+        m_buffer >>= chunk;
+        m_num_bits = m_num_bits > chunk ? m_num_bits - chunk : 0;
+        shift += chunk;
+    }
+    return value;
+}
+
+uint64_t BitReader::read_unary()
+{
+    uint64_t value = 0;
+    refill();
+    while (m_buffer == 0 && m_num_bits > 0) {
+        value += m_num_bits;
+        m_num_bits = 0;
+        refill();
+    }
+    if (m_buffer == 0) {
+        m_corrupt = true;   // past the end of a corrupt stream
+        return value;
+    }
+    unsigned int zeros = __builtin_ctzll(m_buffer);
+    m_buffer >>= zeros + 1;
+    m_num_bits -= zeros + 1;
+    return value + zeros;
+}
+
+uint64_t BitReader::read_gamma()
+{
+    uint64_t num_bits = read_unary();
+    if (num_bits >= 64) {
+        m_corrupt = true;
+        return 0;
+    }
+    return ((uint64_t) 1 << num_bits) | read(num_bits);
+}
+
+uint64_t BitReader::read_rice(unsigned int k)
+{
+    uint64_t quotient = read_unary();
+    if (k > 0 && (quotient >> (64 - k)) != 0) {
+        m_corrupt = true;
+        return 0;
+    }
+    return (quotient << k) | read(k);
 }
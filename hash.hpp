@@ -2,6 +2,9 @@
 #define HASH_H
 
 #include <array>
+#include <vector>
+#include <type_traits>
+#include <functional>
 
 #include "configs.hpp"
 #include "memory_manager.hpp"
@@ -10,28 +13,216 @@
 
 typedef uint64_t            Entry;
 typedef unsigned char*      Bucket;
+typedef uint64_t            Slot;       // directory slot: empty (0), inline entries or a bucket
 
 
-extern MemoryManager manager;
+// LCG parameters
+const uint64_t LCG_A = (uint64_t) 1037;  // 2^20+1; 1.4M
 
+// entries, the code followed by the value and the proof bit, are read with one 8-byte load
+// from any bit offset, so they are at most 57 bits
+const unsigned int MAX_CODE_BITS = 55;
+
+// directory slots are SLOT_SIZE bytes:
+// inline slots: bit 0 is the tag, bits 1-3 the size, followed by the sorted entries;
+// small buckets live in the slot itself and only larger ones spill to the heap.
+// other slots: 1 + bucket offset from the memory manager base in units of SLOT_GRANULE bytes, shifted by 1
+const uint64_t SLOT_BITS = 8 * SLOT_SIZE;
+const uint64_t SLOT_GRANULE = 2;    // buckets are allocated in multiples of this
+const uint64_t SLOT_HEADER_BITS = 4;
+static_assert(SLOT_SIZE <= sizeof(Slot), "a directory slot is at most 8 bytes");
+static_assert(SLOT_SIZE == sizeof(Slot) || std::is_same<MemoryManager, CustomMemoryManager>::value,
+              "slots narrower than a pointer store offsets into the CustomMemoryManager pool");
+
+// front cache: recently probed full hashcodes and their values; value -1 marks an empty line
+static_assert(1 <= FRONT_CACHE_BITS && FRONT_CACHE_BITS < 32, "the front cache has 2 to 2^31 lines");
+
+struct FrontLine
+{
+    uint64_t hashcode;
+    int value;
+};
 
-// table of buckets
-const uint64_t CAPACITY = (uint64_t) 1 << IDX_BITS;
+// layered hashcodes: the number of stones is kept above the base-3 code of the board,
+// or above the rank of ranked positions
+const unsigned int LAYER_SHIFT = 58;
 
-// LCG parameters
-const uint64_t LCG_M = (uint64_t) 1 << (IDX_BITS + CODE_BITS);   // range of all hashcode
-const uint64_t LCG_A = (uint64_t) 1037;  // 2^20+1; 1.4M
+// most points of a board whose hashcodes fit into 64 bits: 3^40 base-3 codes, 36 points below
+// the layer, or 32 points of ranked keys
+const int MAX_POINTS = RANKED_KEYS ? 32 : (LAYERED_TABLE ? 36 : 40);
+
+// table-wide scans: directories are cut into ranges of SCAN_RANGE_SLOTS slots, which
+// SCAN_THREADS threads take in turn; regions of REGION_SLOTS slots never written to are skipped
+const uint64_t REGION_BITS = 12;
+const uint64_t REGION_SLOTS = (uint64_t) 1 << REGION_BITS;
+const uint64_t SCAN_RANGE_SLOTS = (uint64_t) 1 << 20;
+
+// solution files start with this magic and version
+const char SOLUTION_MAGIC[] = "SBHS";
+const uint32_t SOLUTION_VERSION = 1;
+
+// table files, mapped and queried in place, start with this magic and the same version
+const char TABLE_MAGIC[] = "SBHT";
+const uint64_t TABLE_ALIGNMENT = 4096;  // directories start on a page
+
+// strategy files, one winning move per winning position, start with this magic and the same version
+const char STRATEGY_MAGIC[] = "SBHG";
+
+struct ScanRange
+{
+    int stones;         // layer
+    uint64_t begin;     // slots [begin, end)
+    uint64_t end;
+};
+
+// buckets longer than this are binary searched down to a window of this size,
+// which is then scanned linearly
+const uint64_t SCAN_THRESHOLD = 32;
+
+// parallel proofs and set_proof_bits: positions per task
+const uint64_t PROOF_BATCH = 1 << 10;
+
+// frozen tables: the position of every FROZEN_SAMPLE-th zero of the high bits is kept
+const uint64_t FROZEN_SAMPLE = 256;
+
+
+class Layout
+/* Bit layout of a table, chosen at run time from the board size.
+ * A hashcode of idx_bits + code_bits bits is split into the index of its slot
+ * and the validation code kept in an entry, together with the value bit and proof bit.
+ * Entries take entry_bits bits in buckets and slots, and entry_size bytes in files. */
+{
+public:
+    unsigned int idx_bits;      // num bits: index
+    unsigned int code_bits;     // num bits: validation code
+    unsigned int entry_size;    // num bytes: of an entry, rounded up
+    unsigned int entry_bits;    // num bits: of an entry in table, packed or in whole bytes
+    uint64_t capacity;          // table of buckets
+    uint64_t lcg_mask;          // range of all hashcode, minus 1
+    Entry code_mask;            // entry masks
+    Entry value_mask;
+    Entry proof_mask;
+    Entry entry_mask;
+    uint64_t header_size;       // bucket header: size and capacity, entry_size bytes each
+    uint64_t max_bucket_size;
+    uint64_t pad_size;          // num bytes: after the entries of a bucket, for word-sized access
+    uint64_t inline_capacity;   // num entries fitting in a directory slot
+    uint64_t lane_ones;         // bit 0 of each whole packed entry in a 64-bit word, for SWAR probes
+    uint64_t load_lanes;        // num entries: whole in an 8-byte load from any bit offset
+    unsigned int top_lane;      // bit 0 of the last entry of lane_ones
+
+    Layout() {};
+    Layout(unsigned int idx_bits, unsigned int code_bits);
+
+    /* Largest directory within budget, leaving at least MIN_CODE_BITS for the code,
+     * such that idx_bits + code_bits covers all 3^num_points hashcodes */
+    static Layout for_board(int num_points, uint64_t budget=DIRECTORY_BUDGET);
+
+    /* Same for hashcodes in [0, num_codes) */
+    static Layout for_codes(uint64_t num_codes, uint64_t budget);
+
+    /* Fewest index bits of total_bits hashcodes, leaving at most MAX_CODE_BITS for the code */
+    static unsigned int min_idx_bits(unsigned int total_bits);
+
+    /* Entry of a layout with more code bits, re-encoded without its top code bits */
+    Entry narrow(const Layout &from, Entry entry) const;
+};
+
+template <unsigned int CODE_BITS>
+class FixedLayout
+/* The fields of Layout that lookups read, fixed at compile time for one code width,
+ * so that probes of tables with that width compile to constant masks and shifts.
+ * Hash::get_from_slot takes this path when matches(layout), and the run-time layout otherwise. */
+{
+public:
+    static constexpr unsigned int code_bits = CODE_BITS;
+    static constexpr unsigned int entry_size = (CODE_BITS + 2 + 7) / 8;
+    static constexpr unsigned int entry_bits = PACK_ENTRIES ? CODE_BITS + 2 : 8 * entry_size;
+    static constexpr Entry code_mask = ((Entry) 1 << CODE_BITS) - 1;
+    static constexpr Entry value_mask = (Entry) 1 << CODE_BITS;
+    static constexpr Entry proof_mask = (Entry) 1 << (CODE_BITS + 1);
+    static constexpr Entry entry_mask = (Entry) -1 >> (8*sizeof(Entry) - entry_bits);
+    static constexpr uint64_t header_size = 2 * entry_size;
+    static constexpr unsigned int top_lane = (64 / entry_bits - 1) * entry_bits;
+    static constexpr uint64_t lane_ones = ((uint64_t) -1 >> (64 - top_lane - entry_bits)) / entry_mask;
+    static constexpr uint64_t load_lanes = (64 - 7) / entry_bits;
+
+    static bool matches(const Layout &layout)
+    {
+        return layout.code_bits == code_bits && layout.entry_bits == entry_bits;
+    }
+};
+
+
+class FrozenLayer
+/* Sorted keys of a frozen layer in Elias-Fano code, with a value of value_bits bits per key.
+ * Key i is split into its low_bits lowest bits, packed one after another in lows,
+ * and its high part h, which sets bit h + i of highs. The keys of high part h are
+ * thus the ones between the (h-1)-th and the h-th zero of highs. */
+{
+public:
+    uint64_t size = 0;
+    unsigned int low_bits = 0;
+    unsigned int value_bits = 1;
+    std::vector<uint64_t> lows;
+    std::vector<uint64_t> highs;
+    std::vector<uint64_t> values;
+    std::vector<uint64_t> zero_samples;
+
+    FrozenLayer() {};
+    FrozenLayer(uint64_t size, unsigned int key_bits, unsigned int value_bits = 1);
+
+    /* Keys must come in increasing order */
+    void push_back(uint64_t key, uint64_t value);
+
+    void finish();
+
+    int get(uint64_t key) const;
+
+    int64_t find(uint64_t key) const;
+
+    uint64_t bytes() const;
+
+    void write(std::string &out) const;
 
-// entry masks
-const Entry CODE_MASK = (Entry) -1 >> (8*sizeof(Entry) - CODE_BITS);
-const Entry VALUE_MASK = (Entry) 1 << CODE_BITS;
-const Entry PROOF_MASK = (Entry) 1 << (CODE_BITS + 1);
+    bool read(const char* &pos, const char* end);
+
+private:
+    static void write_bits(std::vector<uint64_t> &words, uint64_t bit, unsigned int n, uint64_t x);
+
+    static uint64_t read_bits(const std::vector<uint64_t> &words, uint64_t bit, unsigned int n);
+
+    uint64_t select_zero(uint64_t rank) const;
+};
+
+
+class Layer
+/* Directory of the positions with one number of stones, or of all positions
+ * when the table is not layered. Each layer has its own layout and grows on its own. */
+{
+public:
+    unsigned char* table;       // directory of slots, mapped lazily
+    Layout layout;
+    Layout max_layout;          // layout the directory grows up to, and of solution files
+    uint64_t file_offset;       // index of the first slot of this layer in solution files
+    uint64_t size = 0;
+    uint64_t proof_size = 0;
+    uint64_t grow_size;         // num entries: beyond which the directory doubles
+    std::vector<unsigned char> occupancy;   // per region: 1 once one of its slots was written to;
+                                            // bytes, so that parallel scans never share one
+    FrozenLayer frozen;         // all entries of the layer once the table is frozen
+    FrozenLayer strategy;       // winning positions of a strategy, kept apart from the table
+};
+
+
+/* Run task(i) for every i < num_tasks on up to SCAN_THREADS threads */
+void run_parallel(uint64_t num_tasks, const std::function<void(uint64_t)> &task);
 
 
 class Hash
 {
 public:
-    Bucket* m_hashtable = new Bucket[CAPACITY]; // call default constructor of Entry
+    std::vector<Layer> m_layers;    // indexed by number of stones when LAYERED_TABLE
     int m_boardsize[2];
     int m_num_points;
     uint64_t* m_poly_terms;
@@ -41,6 +232,10 @@ public:
     Hash(int height, int width);
     ~Hash();
 
+    // each table owns its buckets; copying would free them twice
+    Hash(const Hash&) = delete;
+    Hash& operator=(const Hash&) = delete;
+
     void initialize(int height, int width);
 
     void free_buckets();
@@ -49,22 +244,32 @@ public:
 
     void clear();
 
+    void clear_layer(int stones);
+
     uint64_t hash_func(Grid &board2d);
 
     uint64_t hash_func(uint64_t hashcode, int point, int color);
 
     uint64_t linear_congruence_func(uint64_t hashcode);
 
-    Entry format_entry_insert(Entry code, int value);
+    void colors_of(uint64_t hashcode, std::vector<int> &colors);
 
-    int format_entry_get(Entry entry);
+    Entry format_entry_insert(const Layout &layout, Entry code, int value);
+
+    int format_entry_get(const Layout &layout, Entry entry);
 
     bool insert(uint64_t hashcode, int value);
 
     int get(uint64_t hashcode);
 
+    void get_many(std::vector<uint64_t> &hashcodes, std::vector<int> &values);
+
+    int peek(uint64_t hashcode);
+
     bool set_proof_bit(uint64_t hashcode);
 
+    uint64_t set_proof_bits(std::vector<uint64_t> &hashcodes);
+
     bool get_proof_bit(uint64_t hashcode);
 
     uint64_t size();
@@ -73,37 +278,233 @@ public:
 
     void clear_proof_bit();
 
+    uint64_t collect_garbage();
+
     std::string store(std::string file_name, bool proof_only=true);
 
     std::string load(std::string file_name);
 
+    std::string store_table(std::string file_name);
+
+    std::string open_table(std::string file_name);
+
+    bool is_mapped() { return m_mapped_file != 0; };
+
+    uint64_t freeze(bool proof_only=true);
+
+    bool is_frozen() { return m_frozen; };
+
+    void set_strategy(std::vector<std::pair<uint64_t, int>> &moves);
+
+    std::string store_strategy(std::string file_name);
+
+    std::string load_strategy(std::string file_name);
+
+    int strategy_move(uint64_t hashcode);
+
     Entry get_raw(uint64_t idx);
 
+    Layer& layer_of(uint64_t hashcode);
+
+    uint64_t rank(uint64_t hashcode);
+
+    uint64_t num_ranks(int stones);
+
+    Slot read_slot(const Layer &layer, uint64_t idx);
+
+    bool write_proof_bit(Layer &layer, uint64_t hashcode);
+
+    void write_slot(Layer &layer, uint64_t idx, Slot slot);
+
+    std::vector<Entry> read_entries(Layer &layer, uint64_t idx);
+
+    void write_entries(Layer &layer, uint64_t idx, std::vector<Entry> &entries, unsigned char* memory=0);
+
 private:
-    uint64_t m_size = 0;
-    uint64_t m_proof_size = 0;
+    void map_directory(Layer &layer);
+
+    void reset_directory(Layer &layer, Layout layout);
+
+    Layout initial_layout(const Layout &max_layout);
+
+    void free_buckets(int stones);
+
+    std::vector<ScanRange> scan_ranges(int stones=-1);
+
+    bool skip_region(const Layer &layer, uint64_t &idx);
+
+    void store_range(const ScanRange &range, bool proof_only, std::string &shard);
+
+    std::string solution_header(const char* magic=SOLUTION_MAGIC);
+
+    std::string table_header();
+
+    void close_table();
+
+    uint64_t count_entries(int stones, bool proof_only);
+
+    Bucket bucket_of(const Layout &layout, Slot slot);
+
+    bool load_block(const unsigned char* block, uint64_t end_idx, unsigned char* memory, uint64_t* layer_sizes,
+                    uint64_t &num_bytes);
+
+    uint64_t file_slots();
+
+    bool mapped_directory_valid(unsigned char* data, uint64_t length, uint64_t dir_pos, const Layout &layout);
+
+    int file_layer(uint64_t file_idx);
+
+    void grow(Layer &layer);
+
+    int get_from_slot(const Layout &layout, Slot slot, Entry code);
+
+    FrontLine& front_line(uint64_t hashcode);
+
+    void clear_front_cache();
+
+    MemoryManager m_manager;    // per-table arena, so several solvers can coexist
+    std::vector<Slot> m_batch_slots;    // slots of the batch in get_many
+    std::vector<FrontLine> m_front_cache;
+    std::vector<std::vector<uint64_t>> m_binomials;     // C(i, j) for i, j up to the number of points
+    std::vector<uint64_t> m_rank_offsets;   // first key of each number of stones, when ranked but not layered
+    unsigned char* m_mapped_file = 0;       // table opened by open_table, read-only; its buckets are
+    uint64_t m_mapped_length = 0;           // addressed from the start of the file
+    bool m_frozen = false;                  // entries only in the frozen layers, read-only
 };
 
 class BucketUtil
 {
 public:
-    static Bucket initialize();
+    static Bucket allocate(const Layout &layout, MemoryManager &manager, uint64_t capacity);
+
+    static Bucket place(const Layout &layout, unsigned char* memory, uint64_t capacity);
+
+    template <class L>
+    static uint64_t size(const L &layout, Bucket bucket);
+
+    static uint64_t capacity(const Layout &layout, Bucket bucket);
+
+    template <class L>
+    static Bucket load(const L &layout, Bucket bucket);
+
+    static uint64_t bytes(const Layout &layout, uint64_t capacity);
+
+    static uint64_t grow(const Layout &layout, uint64_t capacity);
+
+    static void write_field(const Layout &layout, Bucket bucket, uint64_t idx, uint64_t value);
+
+    template <class L>
+    static uint64_t read_field(const L &layout, Bucket bucket, uint64_t idx);
+
+    static void write_entry(const Layout &layout, Bucket bucket, uint64_t idx, Entry entry);
+
+    template <class L>
+    static Entry read_entry(const L &layout, Bucket bucket, uint64_t idx);
+
+    static Bucket insert(const Layout &layout, MemoryManager &manager, Bucket bucket, Entry entry);
+
+    template <class L>
+    static std::array<Entry, 2> get(const L &layout, Bucket bucket, Entry code);
+
+    static bool set_proof_bit(const Layout &layout, Bucket bucket, Entry code);
+
+    static bool get_proof_bit(const Layout &layout, Bucket bucket, Entry code);
+
+    template <class L>
+    static std::array<int, 2> find(const L &layout, Bucket bucket_load, Entry code, uint64_t size);
+
+    template <class L>
+    static uint64_t count_less(const L &layout, Bucket bucket_load, Entry code, uint64_t low, uint64_t high);
+};
+
+class BitWriter
+/* Appends bits to a byte string, least significant bit first */
+{
+public:
+    BitWriter(std::string &bytes) : m_bytes(bytes) {};
+
+    void write(uint64_t value, unsigned int num_bits);
+
+    void write_unary(uint64_t value);
+
+    void write_gamma(uint64_t value);
+
+    void write_rice(uint64_t value, unsigned int k);
+
+    void flush();
+
+private:
+    std::string &m_bytes;
+    uint64_t m_buffer = 0;
+    unsigned int m_num_bits = 0;
+};
+
+class BitReader
+/* Reads the bits of a BitWriter straight from memory */
+{
+public:
+    BitReader(const unsigned char* data, uint64_t size) : m_pos(data), m_end(data + size) {};
+
+    uint64_t read(unsigned int num_bits);
+
+    uint64_t read_unary();
+
+    uint64_t read_gamma();
+
+    uint64_t read_rice(unsigned int k);
+
+    /* Whether a read ran past the end of the data, or decoded a value beyond 64 bits */
+    bool corrupt() const { return m_corrupt; };
+
+private:
+    void refill();
+
+    const unsigned char* m_pos;
+    const unsigned char* m_end;
+    uint64_t m_buffer = 0;
+    unsigned int m_num_bits = 0;
+    bool m_corrupt = false;
+};
+
+class SlotUtil
+{
+public:
+    static bool is_inline(Slot slot);
+
+    static Bucket to_bucket(const Layout &layout, MemoryManager &manager, Slot slot);
+
+    static Bucket to_bucket(unsigned char* base, Slot slot);
+
+    static Slot from_bucket(const Layout &layout, MemoryManager &manager, Bucket bucket);
+
+    static Slot from_offset(uint64_t offset);
+
+    static Slot initialize(const Layout &layout, Entry entry);
+
+    static uint64_t size(Slot slot);
+
+    template <class L>
+    static Entry read_entry(const L &layout, Slot slot, uint64_t idx);
+
+    static Slot write_entry(const Layout &layout, Slot slot, uint64_t idx, Entry entry);
 
-    static Bucket initialize(Entry entry);
+    static Slot insert(const Layout &layout, MemoryManager &manager, Slot slot, Entry entry);
 
-    static void write_entry(Bucket bucket, uint64_t idx, Entry entry);
+    template <class L>
+    static std::array<Entry, 2> get(const L &layout, Slot slot, Entry code);
 
-    static Entry read_entry(Bucket bucket, uint64_t idx);
+    static bool set_proof_bit(const Layout &layout, Slot &slot, Entry code);
 
-    static Bucket insert(Bucket bucket, Entry entry);
+    static bool get_proof_bit(const Layout &layout, Slot slot, Entry code);
 
-    static std::array<Entry, 2> get(Bucket bucket, Entry code);
+    template <class L>
+    static std::array<int, 2> find(const L &layout, Slot slot, Entry code);
 
-    static bool set_proof_bit(Bucket bucket, Entry code);
+    static void unpack(const Layout &layout, Slot slot, Bucket bucket_load);
 
-    static bool get_proof_bit(Bucket bucket, Entry code);
+    static Slot pack(const Layout &layout, std::vector<Entry> &entries);
 
-    static std::array<int, 2> binary_search(Bucket bucket_load, Entry code, int low, int high);
+    static std::vector<Entry> entries(const Layout &layout, MemoryManager &manager, Slot slot);
 };
 
 #endif
@@ -1,23 +1,116 @@
 #include "board.hpp"
 #include "gtp_connection.hpp"
+#include "batch.hpp"
 #include "hash.hpp"
 #include "memory_manager.hpp"
 #include "configs.hpp"
 #include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <cstdio>
 
 
-MemoryManager manager;
-Hash hash(N_ROWS, N_COLS);
-
+int usage(const char* program)
+/* Print the command lines of the solver; returns the exit status of a usage error */
+{
+    std::cerr << "usage: " << program << " [--size <rows>x<cols>]\n"
+              << "       " << program << " [--size <rows>x<cols>] --batch <positions file> [--out <results file>]"
+              << " [--json] [--time <seconds>] [--nodes <count>] [--memory <MB>]\n";
+    return 1;
+}
 
-int main()
+int main(int argc, char* argv[])
+/* Without --batch, a GTP connection on stdin and stdout;
+ * with it, solve every position of the file and exit */
 {
+    int height = N_ROWS;
+    int width = N_COLS;
+    std::string batch_file;
+    std::string out_file;
+    bool json = false;
+    double seconds = 0;
+    uint64_t nodes = 0;
+    uint64_t memory = 0;
+    for (int i = 1; i < argc; i++) {
+        std::string option = argv[i];
+        if (option == "--json") {
+            json = true;
+            continue;
+        }
+        if (i + 1 == argc) {
+            return usage(argv[0]);
+        }
+        const char* arg = argv[++i];
+        char* end = 0;
+        if (option == "--size") {
+            char sep = 0;
+            int n = std::sscanf(arg, "%dx%d%c", &height, &width, &sep);
+            if (n != 2 || height < 1 || width < 1 || height > MAX_POINTS || width > MAX_POINTS
+                || height * width > MAX_POINTS) {
+                return usage(argv[0]);
+            }
+            continue;
+        }
+        else if (option == "--batch") {
+            batch_file = arg;
+            continue;
+        }
+        else if (option == "--out") {
+            out_file = arg;
+            continue;
+        }
+        else if (option == "--time") {
+            seconds = std::strtod(arg, &end);
+        }
+        else if (option == "--nodes") {
+            nodes = std::strtoull(arg, &end, 10);
+        }
+        else if (option == "--memory") {
+            memory = std::strtoull(arg, &end, 10) << 20;
+        }
+        if (end == 0 || end == arg || *end != '\0') {
+            return usage(argv[0]);
+        }
+    }
+    if (batch_file.empty() && (! out_file.empty() || json || seconds > 0 || nodes > 0 || memory > 0)) {
+        return usage(argv[0]);
+    }
+
+    std::ifstream positions;
+    std::ofstream out;
+    if (! batch_file.empty()) {
+        positions.open(batch_file);
+        if (! positions.is_open()) {
+            std::cerr << "Abort: failed to open " << batch_file << "!\n";
+            return 1;
+        }
+    }
+    if (! out_file.empty()) {
+        out.open(out_file);
+        if (! out.is_open()) {
+            std::cerr << "Abort: failed to open " << out_file << "!\n";
+            return 1;
+        }
+    }
+
     srand(time(0));
-    NoGoBoard board(N_ROWS, N_COLS);
-    Search search(N_ROWS, N_COLS);
+    Hash hash(height, width);       // owns the table and its memory manager
+    NoGoBoard board(height, width);
+    Search search(hash, height, width);
     NoGo nogo_engine(board, search);
-    GtpConnection con(nogo_engine);
-    con.start_connection();
+
+    if (batch_file.empty()) {
+        GtpConnection con(nogo_engine);
+        con.start_connection();
+        return 0;
+    }
+
+    Batch batch(nogo_engine, json);
+    batch.m_budget.seconds = seconds;
+    batch.m_budget.nodes = nodes;
+    batch.m_budget.memory = memory;
+    int num_unsolved = batch.run(positions, out_file.empty() ? std::cout : out);
+    std::cerr << "BATCH completed: " << num_unsolved << " positions unsolved.\n";
 
     return 0;
 }
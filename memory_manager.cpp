@@ -1,9 +1,36 @@
+#include <algorithm>
 #include <cstdlib>
 #include <iostream>
 
 #include "memory_manager.hpp"
 
 
+void* DefaultMemoryManager::realloc(void* ptr, size_t size, size_t old_size)
+{
+    if (in_arena(ptr) == false) {
+        return std::realloc(ptr, size);
+    }
+    void* new_ptr = std::malloc(size);
+    std::memcpy(new_ptr, ptr, std::min(size, old_size));
+    return new_ptr;
+}
+
+void* DefaultMemoryManager::arena(size_t size)
+/* One arena at a time */
+{
+    release_arena();
+    m_arena = (unsigned char*) std::malloc(size);
+    m_arena_size = size;
+    return m_arena;
+}
+
+void DefaultMemoryManager::release_arena()
+{
+    std::free(m_arena);
+    m_arena = 0;
+    m_arena_size = 0;
+}
+
 CustomMemoryManager::CustomMemoryManager()
 {
     for (int i = 0; i < 8; i++) {
@@ -64,6 +91,9 @@ void CustomMemoryManager::free(void* ptr, size_t size)
 
 void CustomMemoryManager::add_to_recycled_list(unsigned char* ptr, size_t size)
 {
+    if (size >= RECYCLE_SIZE) {
+        return;     // too large to be binned; left unused in the pool
+    }
     if (size < 8) {
         add_chunk(ptr, size);
     }
@@ -79,6 +109,9 @@ void CustomMemoryManager::add_to_recycled_list(unsigned char* ptr, size_t size)
 unsigned char* CustomMemoryManager::get_from_recycled_list(size_t size)
 {
     unsigned char* ptr = 0;
+    if (size >= RECYCLE_SIZE) {
+        return ptr;
+    }
     if (size < 8) {
         ptr = get_chunk(size);
     }
@@ -2,6 +2,7 @@
 #define H_MEMORY_MANAGER
 
 #include <cstdint>
+#include <cstdlib>
 #include <cstring>
 
 
@@ -24,6 +25,12 @@ public:
     void free(void* ptr, size_t size) {};
 
     uint64_t pool_usage() { return 0; };
+
+    unsigned char* base() { return 0; };    // allocations are addressed relative to base
+
+    void* arena(size_t size) { return 0; };     // one block of memory carved into many allocations
+
+    void release_arena() {};
 };
 
 
@@ -31,13 +38,25 @@ class DefaultMemoryManager: public BaseMemoryManager
 {
 public:
     DefaultMemoryManager() {};
-    ~DefaultMemoryManager() {};
+    ~DefaultMemoryManager() { std::free(m_arena); };
 
     void* malloc(size_t size) { return std::malloc(size); };
 
-    void* realloc(void* ptr, size_t size, size_t old_size=0) { return std::realloc(ptr, size); };
+    void* realloc(void* ptr, size_t size, size_t old_size=0);
+
+    void free(void* ptr, size_t size=0) { if (in_arena(ptr) == false) std::free(ptr); };
+
+    /* Pieces of the arena are not freed one by one: freeing them does nothing,
+     * and reallocating moves them out. The arena goes with release_arena. */
+    void* arena(size_t size);
+
+    void release_arena();
 
-    void free(void* ptr, size_t size=0) { std::free(ptr); };
+private:
+    bool in_arena(void* ptr) { return ptr >= m_arena && ptr < m_arena + m_arena_size; };
+
+    unsigned char* m_arena = 0;
+    size_t m_arena_size = 0;
 };
 
 
@@ -60,6 +79,13 @@ public:
 
     uint64_t pool_usage();
 
+    unsigned char* base() { return pool; };
+
+    /* Pieces of the arena are recycled like any other allocation of the pool */
+    void* arena(size_t size) { return malloc(size); };
+
+    void release_arena() {};
+
 private:
     void add_to_recycled_list(unsigned char* ptr, size_t size);
 
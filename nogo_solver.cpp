@@ -1,6 +1,6 @@
-#include <signal.h>
-#include <unistd.h>
 #include <iostream>
+#include <algorithm>
+#include <numeric>
 
 #include "nogo_solver.hpp"
 
@@ -104,8 +104,16 @@ int NoGo::undo()
     return 0;
 }
 
-int NoGo::solve()
+int NoGo::solve(SolveBudget* budget)
+/* Return the value of the current board; -1 if the budget ran out first,
+ * which leaves the values solved so far in the table for the next solve.
+ * Without a budget, the solve runs on an unlimited one of its own, which counts its nodes. */
 {
+    close_table();
+    SolveBudget unlimited;
+    if (budget == 0) {
+        unlimited.restart();
+    }
     std::chrono::steady_clock::time_point beg = std::chrono::steady_clock::now();
 
     Grid board2d = board.twoD_board();
@@ -113,24 +121,91 @@ int NoGo::solve()
     std::vector<int> empty_points = board.get_empty_points();
     int d = (board.size[0] * board.size[1] - (int) empty_points.size());
 
-    signal(SIGALRM, sig_handler);
-    alarm(10);
+    search.m_budget = budget != 0 ? budget : &unlimited;
+    search.m_budget_nodes = 0;
+    search.m_report_time = std::chrono::steady_clock::now();
+    search.m_report_nodes = 0;
+    search.m_root_depth = d;
+    search.m_progress.assign(PROGRESS_DEPTH, ProgressFrame());
     int value = search.negamax(board, hashcode, d);
-    alarm(0);
+    search.m_budget = 0;
     std::fprintf(stderr, "\33[2K\r");   // clear intermediate prints
 
     std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
     elapsed_time = std::chrono::duration_cast<std::chrono::seconds>(end - beg);
 
+    if (budget != 0) {
+        budget->nodes_searched = search.m_budget_nodes;
+        budget->estimated_nodes = search.m_budget_nodes;
+        if (budget->stop_reason != 0) {
+            return -1;
+        }
+    }
+    if (GC_MEMORY_SHARE > 0 && resident_bytes() > GC_MEMORY_SHARE * physical_bytes()) {
+        std::cerr << "collecting garbage...\n";
+        collect_garbage();
+    }
     return value;
 }
 
-bool NoGo::prove()
+bool NoGo::prove(bool minimal)
+/* With minimal, extract proofs that follow, at each winning position, the move with the smallest
+ * proof tree in the table, counting the nodes of the last proof as free; retry while it shrinks,
+ * up to MINIMAL_PROOF_PASSES passes, and keep the smallest proof. */
 {
+    close_table();
     Grid board2d = board.twoD_board();
     uint64_t hashcode = hash.hash_func(board2d);
+    int value = hash.get(hash.linear_congruence_func(hashcode));
+
+    if (minimal == false) {
+        std::array<bool, 2> result = search.parallel_proof(board, hashcode);
+        if (result[1] == true) {
+            std::cerr << "PROOF completed.\n";
+            search.print_verify_stats();
+        }
+        else {
+            std::cerr << "PROOF failed.\n";
+        }
+        return result[0];
+    }
+
+    hash.clear_proof_bit();     // an earlier proof would otherwise come out again for free
+    std::array<bool, 2> result = {false, false};
+    std::vector<uint64_t> best_proof;   // true hashcodes of the smallest proof so far
+    std::vector<uint64_t> best_depths;
+    bool last_is_best = true;
+    for (unsigned int pass = 0; pass < MINIMAL_PROOF_PASSES && value != -1; pass++) {
+        std::cerr << "estimating proof sizes...\n";
+        search.proof_tree_size(board, hashcode, value);     // before the last proof is dropped
+        hash.clear_proof_bit();
+        std::fill(std::begin(search.m_nodes_at_depth), std::end(search.m_nodes_at_depth), 0);
+        search.m_minimal_proof = true;
+        std::array<bool, 2> pass_result = search.proof_negamax(board, hashcode);
+        search.m_minimal_proof = false;
+        std::unordered_map<uint64_t, uint64_t>().swap(search.m_proof_sizes);
+        if (pass_result[1] == false) {
+            last_is_best = best_proof.empty();
+            break;
+        }
+        std::cerr << "proof of " << hash.proof_size() << " nodes\n";
+        result = pass_result;
+        if (best_proof.empty() == false && search.m_proof_nodes.size() >= best_proof.size()) {
+            last_is_best = search.m_proof_nodes.size() == best_proof.size();    // as small will do
+            break;
+        }
+        best_proof.swap(search.m_proof_nodes);
+        best_depths.assign(std::begin(search.m_nodes_at_depth), std::end(search.m_nodes_at_depth));
+        search.m_proof_nodes.clear();
+    }
+    std::vector<uint64_t>().swap(search.m_proof_nodes);
+    if (last_is_best == false) {
+        std::cerr << "restoring the proof of " << best_proof.size() << " nodes\n";
+        hash.clear_proof_bit();
+        hash.set_proof_bits(best_proof);
+        std::copy(best_depths.begin(), best_depths.end(), std::begin(search.m_nodes_at_depth));
+    }
 
-    std::array<bool, 2> result = search.proof_negamax(board, hashcode);
     if (result[1] == true) {
         std::cerr << "PROOF completed.\n";
         search.print_verify_stats();
@@ -141,32 +216,148 @@ bool NoGo::prove()
     return result[0];
 }
 
+int64_t NoGo::collect_garbage()
+/* Prove the current position, then drop the entries outside its proof.
+ * Return the number of entries dropped; -1 if the position cannot be proved. */
+{
+    close_table();
+    Grid board2d = board.twoD_board();
+    uint64_t hashcode = hash.hash_func(board2d);
+
+    std::array<bool, 2> result = search.parallel_proof(board, hashcode);
+    if (result[1] == false) {
+        return -1;
+    }
+    return hash.collect_garbage();
+}
+
 std::string NoGo::store_solution(std::string f_name)
 {
+    close_table();
     return hash.store(f_name);
 }
 
 std::string NoGo::load_solution(std::string f_name)
 {
-    solution_loaded = f_name;
     std::cerr << "trying to load solution...\n";
-    return hash.load(f_name);
+    solution_loaded = hash.load(f_name);
+    return solution_loaded;
+}
+
+int NoGo::verify_solution(std::string f_name)
+/* Check a solution file on a table of its own, against the rules only: from the current board, every
+ * winning position needs a losing child in the file and every losing one all its children winning.
+ * Every losing child in the file is followed, and every node of the file must be reached, so that
+ * no stored node is left unchecked. Return the value of the current board; -1 if the file does not
+ * prove it, or holds nodes its proofs do not reach. */
+{
+    std::cerr << "trying to verify solution...\n";
+    Hash solution(board.size[0], board.size[1]);
+    if (solution.load(f_name).empty()) {
+        return -1;
+    }
+    Search checker(solution, board.size[0], board.size[1]);
+    Grid board2d = board.twoD_board();
+    uint64_t hashcode = solution.hash_func(board2d);
+
+    std::array<bool, 2> result = checker.parallel_proof(board, hashcode, false);
+    if (result[1] == false) {
+        std::cerr << "VERIFICATION failed.\n";
+        return -1;
+    }
+    uint64_t num_checked = std::accumulate(std::begin(checker.m_nodes_at_depth), std::end(checker.m_nodes_at_depth), (uint64_t) 0);
+    if (num_checked < solution.size()) {
+        std::cerr << "VERIFICATION failed: " << solution.size() - num_checked << " of " << solution.size()
+                  << " nodes unreachable from the current board, left unchecked.\n";
+        return -1;
+    }
+    std::cerr << "VERIFICATION completed: " << num_checked << " nodes checked.\n";
+    checker.print_verify_stats();
+    return result[0];
+}
+
+std::string NoGo::store_table(std::string f_name)
+{
+    close_table();
+    return hash.store_table(f_name);
+}
+
+std::string NoGo::open_table(std::string f_name)
+{
+    std::cerr << "trying to open table...\n";
+    solution_loaded = hash.open_table(f_name);
+    return solution_loaded;
+}
+
+void NoGo::close_table()
+/* Mapped and frozen tables are read-only: searching, proving and storing start over from an empty table */
+{
+    if (hash.is_mapped()) {
+        std::cerr << "closing mapped table...\n";
+        hash.clear();
+    }
+    if (hash.is_frozen()) {
+        std::cerr << "dropping frozen table...\n";
+        hash.clear();
+    }
+}
+
+int64_t NoGo::freeze(bool proof_only)
+/* Return the bytes of the frozen table; -1 if the table is read-only already. */
+{
+    if (hash.is_mapped() || hash.is_frozen()) {
+        return -1;
+    }
+    return hash.freeze(proof_only);
+}
+
+int64_t NoGo::store_strategy(std::string f_name)
+/* Store the winning moves along the solution of the current board, which then also serve genmove.
+ * Return the number of winning positions stored; -1 if the board is not solved. */
+{
+    Grid board2d = board.twoD_board();
+    uint64_t hashcode = hash.hash_func(board2d);
+    std::vector<std::pair<uint64_t, int>> strategy;
+    std::unordered_set<uint64_t> visited;
+    if (search.extract_strategy(board, hashcode, strategy, visited) == false) {
+        return -1;
+    }
+    hash.set_strategy(strategy);
+    hash.store_strategy(f_name);
+    return strategy.size();
+}
+
+std::string NoGo::load_strategy(std::string f_name)
+{
+    std::cerr << "trying to load strategy...\n";
+    return hash.load_strategy(f_name);
 }
 
 int NoGo::get_move(int color)
+/* The move of the strategy if there is one, or else a move to a losing child in the table */
 {
     Grid board2d = board.twoD_board();
     uint64_t hashcode = hash.hash_func(board2d);
     uint64_t true_hashcode = hash.linear_congruence_func(hashcode);
+    int strategy_move = hash.strategy_move(true_hashcode);
+    if (strategy_move != -1) {
+        std::cerr << "winning\n";
+        return GoBoardUtil::canonical_point_to_point(strategy_move, board.size);
+    }
     int value = hash.get(true_hashcode);
     if (value == 1) {
         std::cerr << "winning\n";
         std::vector<int> legal_moves = board.generate_legal_moves(board.current_player);
+        std::vector<uint64_t> true_next_hashcodes;
         for (int move : legal_moves) {
             uint64_t next_hashcode = hash.hash_func(hashcode, move, board.current_player);
-            uint64_t true_next_hashcode = hash.linear_congruence_func(next_hashcode);
-            if (hash.get(true_next_hashcode) == 0)
-                return move;
+            true_next_hashcodes.push_back(hash.linear_congruence_func(next_hashcode));
+        }
+        std::vector<int> values;
+        hash.get_many(true_next_hashcodes, values);
+        for (int i = 0; i < (int) legal_moves.size(); i++) {
+            if (values[i] == 0)
+                return legal_moves[i];
         }
     }
     else if (value == 0)
@@ -6,9 +6,6 @@
 #include "search.hpp"
 
 
-extern Hash hash;
-
-
 class NoGo
 {
 public:
@@ -16,13 +13,14 @@ public:
     double version = 1.0;
     NoGoBoard board;
     Search search;
+    Hash& hash;     // shared with search
     std::array<int, 101> line_of_plays = { 0 };  // 0th element is the # of moves played
     std::string solution_loaded;
     std::chrono::seconds elapsed_time;
 
 
     NoGo(NoGoBoard& board, Search& search) :
-        board(board), search(search) {};
+        board(board), search(search), hash(search.m_hash) {};
     ~NoGo() {};
 
     void boardsize(int length, int width);
@@ -37,14 +35,30 @@ public:
 
     int undo();
 
-    int solve();
+    int solve(SolveBudget* budget=0);
+
+    bool prove(bool minimal=false);
 
-    bool prove();
+    int64_t collect_garbage();
 
     std::string store_solution(std::string f_name="solution");
 
     std::string load_solution(std::string f_name="solution");
 
+    int verify_solution(std::string f_name="solution");
+
+    std::string store_table(std::string f_name="table");
+
+    std::string open_table(std::string f_name="table");
+
+    void close_table();
+
+    int64_t freeze(bool proof_only=true);
+
+    int64_t store_strategy(std::string f_name="strategy");
+
+    std::string load_strategy(std::string f_name="strategy");
+
     int get_move(int color);
 
     std::string plays_to_string();
@@ -1,24 +1,40 @@
 #include <unistd.h>
 #include <iostream>
+#include <fstream>
 #include <cassert>
+#include <algorithm>
+#include <atomic>
 
 #include "search.hpp"
 
 
-uint64_t node_count = 0;
-uint64_t nodes_at_depth[100] = { 0 };
-
+uint64_t resident_bytes()
+{
+    std::ifstream statm("/proc/self/statm");
+    uint64_t total_pages = 0;
+    uint64_t resident_pages = 0;
+    statm >> total_pages >> resident_pages;
+    return resident_pages * sysconf(_SC_PAGESIZE);
+}
 
-void sig_handler(int signum)
+uint64_t physical_bytes()
 {
-    alarm(10);
+    return (uint64_t) sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE);
+}
 
-    std::fprintf(stderr, "\33[2K\r%lu nodes/s", node_count / 10);
-    std::fflush(stderr);
-    node_count = 0;
+
+void SolveBudget::restart()
+/* Clear the progress of the last solve and start the clock; the limits stay */
+{
+    nodes_searched = 0;
+    estimated_nodes = 0;
+    stop_reason = 0;
+    start = std::chrono::steady_clock::now();
+    start_memory = resident_bytes();
 }
 
-Search::Search(int height, int width)
+Search::Search(Hash &hash, int height, int width) :
+    m_hash(hash)
 {
     initialize(height, width);
 }
@@ -33,14 +49,19 @@ void Search::initialize(int height, int width)
 
 bool Search::negamax(NoGoBoard &board, uint64_t hashcode, int d)
 /* Return 0 indicating the current board is losing;
- * Return 1 if winning */
+ * Return 1 if winning.
+ * Once the budget is spent, every call returns at once without inserting anything,
+ * so the table keeps only finished values, from which a later solve picks up. */
 {
-    uint64_t true_hashcode = hash.linear_congruence_func(hashcode);
-    int value = hash.get(true_hashcode);
+    if (m_budget != 0 && budget_spent() == true) {
+        return 0;
+    }
+    uint64_t true_hashcode = m_hash.linear_congruence_func(hashcode);
+    int value = m_hash.get(true_hashcode);
 
     // already inside transposition table
     if (value != -1) {
-        node_count++;
+        m_node_count++;
         return value;
     }
 
@@ -49,34 +70,50 @@ bool Search::negamax(NoGoBoard &board, uint64_t hashcode, int d)
 
     // terminal state - no legal moves
     if (valid_moves_size == 0) {
-        hash.insert(true_hashcode, false);
-        node_count++;
+        m_hash.insert(true_hashcode, false);
+        m_node_count++;
         return 0;
     }
 
     int idx = h_etc(hashcode, valid_moves, board.current_player);
     if (idx != -1) {
-        hash.insert(true_hashcode, true);
+        m_hash.insert(true_hashcode, true);
         update_hhtable(board.current_player, valid_moves[idx], d);
-        node_count++;
+        m_node_count++;
         return 1;
     }
 
+    ProgressFrame* frame = 0;
+    if (m_budget != 0 && d - m_root_depth < PROGRESS_DEPTH) {
+        frame = &m_progress[d - m_root_depth];
+        *frame = {valid_moves_size, 0, m_budget_nodes, 0, m_budget_nodes};
+    }
+
     for (int i = 0; i < valid_moves_size; i++) {
         idx = h_history_heuristic(board.current_player, valid_moves);
         int move = valid_moves[idx];
         
-        uint64_t next_hashcode = hash.hash_func(hashcode, move, board.current_player);
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, move, board.current_player);
 
         bool played = board.play_move(move, board.current_player);
         assert(played);
+        if (frame != 0) {
+            frame->move_start = m_budget_nodes;
+        }
         value = 1 - negamax(board, next_hashcode, d+1);     // equivelant to negating the minimax value
         board.undo_move(move);
+        if (m_budget != 0 && m_budget->stop_reason != 0) {
+            return 0;
+        }
+        if (frame != 0) {
+            frame->moves_done++;
+            frame->done_nodes += m_budget_nodes - frame->move_start;
+        }
 
         if (value == 1) {
-            hash.insert(true_hashcode, true);
+            m_hash.insert(true_hashcode, true);
             update_hhtable(board.current_player, move, d);
-            node_count++;
+            m_node_count++;
             return 1;
         }
 
@@ -84,16 +121,83 @@ bool Search::negamax(NoGoBoard &board, uint64_t hashcode, int d)
     }
 
     assert(valid_moves.size() == 0);
-    hash.insert(true_hashcode, false);
-    node_count++;
+    m_hash.insert(true_hashcode, false);
+    m_node_count++;
     return 0;
 }
 
+bool Search::budget_spent()
+/* Count a node; every BUDGET_CHECK_NODES nodes, publish the count, check the limits and
+ * print the speed once PROGRESS_REPORT_SECONDS have passed since the last report.
+ * Return true once the solve is to stop. */
+{
+    m_budget_nodes++;
+    if (m_budget_nodes % BUDGET_CHECK_NODES == 0) {
+        m_budget->nodes_searched = m_budget_nodes;
+        m_budget->estimated_nodes = estimate_nodes();
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+        std::chrono::duration<double> since_report = now - m_report_time;
+        if (since_report.count() >= PROGRESS_REPORT_SECONDS) {
+            uint64_t speed = (m_budget_nodes - m_report_nodes) / since_report.count();
+            std::fprintf(stderr, "\33[2K\r%lu nodes/s", (unsigned long) speed);
+            std::fflush(stderr);
+            m_report_time = now;
+            m_report_nodes = m_budget_nodes;
+        }
+        std::chrono::duration<double> seconds = now - m_budget->start;
+        const char* reason = 0;
+        if (m_budget->seconds > 0 && seconds.count() >= m_budget->seconds) {
+            reason = "time limit";
+        }
+        else if (m_budget->nodes > 0 && m_budget_nodes >= m_budget->nodes) {
+            reason = "node limit";
+        }
+        else if (m_budget->memory > 0 && resident_bytes() >= m_budget->start_memory + m_budget->memory) {
+            reason = "memory limit";    // the table held before the solve does not count
+        }
+        const char* running = 0;
+        if (reason != 0) {
+            m_budget->stop_reason.compare_exchange_strong(running, reason);     // unless aborted already
+        }
+    }
+    return m_budget->stop_reason.load(std::memory_order_relaxed) != 0;
+}
+
+uint64_t Search::estimate_nodes()
+/* Nodes of the whole solve, estimated from the move loops in progress near the root, deepest first:
+ * the moves left in a loop are expected to cost as much as its moves so far, on average, and a
+ * move without a loop in progress below it, as much as the moves done before it, or as much
+ * again as it did so far if there are none. Winning nodes stop at their first winning move,
+ * so this errs on the long side. */
+{
+    int levels = 0;     // loops in progress: each one began under the move in progress above it
+    while (levels < PROGRESS_DEPTH && m_progress[levels].moves_done < m_progress[levels].num_moves
+           && (levels == 0 || m_progress[levels].start >= m_progress[levels-1].move_start)) {
+        levels++;
+    }
+    if (levels == 0) {
+        return m_budget_nodes;
+    }
+
+    double in_progress = -1;    // estimated nodes under the move in progress
+    for (int l = levels - 1; l >= 0; l--) {
+        const ProgressFrame &frame = m_progress[l];
+        double spent = m_budget_nodes - frame.move_start;
+        if (in_progress < 0) {
+            in_progress = frame.moves_done > 0 ? std::max(spent, (double) frame.done_nodes / frame.moves_done)
+                                               : 2 * spent;
+        }
+        double average = (frame.done_nodes + in_progress) / (frame.moves_done + 1);
+        in_progress = frame.done_nodes + in_progress + average * (frame.num_moves - frame.moves_done - 1);
+    }
+    return std::max(m_budget_nodes, m_progress[0].start + (uint64_t) in_progress);
+}
+
 std::array<bool, 2> Search::proof_negamax(NoGoBoard &board, uint64_t hashcode, int d)
 {
-    uint64_t true_hashcode = hash.linear_congruence_func(hashcode);
-    int predicted_value = hash.get(true_hashcode);
-    bool proved = hash.get_proof_bit(true_hashcode);
+    uint64_t true_hashcode = m_hash.linear_congruence_func(hashcode);
+    int predicted_value = m_hash.get(true_hashcode);
+    bool proved = m_hash.get_proof_bit(true_hashcode);
 
     if (proved == true) {
         bool value = predicted_value;
@@ -109,20 +213,20 @@ std::array<bool, 2> Search::proof_negamax(NoGoBoard &board, uint64_t hashcode, i
 
     // terminal state - no legal moves
     if (valid_moves_size == 0) {
-        bool bit_changed = hash.set_proof_bit(true_hashcode);
-        nodes_at_depth[d] += bit_changed;
+        mark_proved(true_hashcode, d);
         return {false, predicted_value==false};
     }
 
     if (predicted_value == 1) {
-        int i = h_etc(hashcode, valid_moves, board.current_player);
+        int i = m_minimal_proof ? h_smallest_proof(board, hashcode, valid_moves)
+                                : h_etc(hashcode, valid_moves, board.current_player);
 
         if (i == -1) {
             return {false, false};
         }
         else {
             int move = valid_moves[i];
-            uint64_t next_hashcode = hash.hash_func(hashcode, move, board.current_player);
+            uint64_t next_hashcode = m_hash.hash_func(hashcode, move, board.current_player);
 
             bool played = board.play_move(move, board.current_player);
             assert(played);
@@ -131,15 +235,14 @@ std::array<bool, 2> Search::proof_negamax(NoGoBoard &board, uint64_t hashcode, i
 
             int value = 1 - result[0];
 
-            bool bit_changed = hash.set_proof_bit(true_hashcode);
-            nodes_at_depth[d] += bit_changed;
+            mark_proved(true_hashcode, d);
             return {true, result[1] == true && predicted_value == value};
         }
     }
 
     for (int i = 0; i < valid_moves_size; i++) {
         int move = valid_moves[i];
-        uint64_t next_hashcode = hash.hash_func(hashcode, move, board.current_player);
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, move, board.current_player);
 
         bool played = board.play_move(move, board.current_player);
         assert(played);
@@ -153,11 +256,157 @@ std::array<bool, 2> Search::proof_negamax(NoGoBoard &board, uint64_t hashcode, i
         }
     }
 
-    bool bit_changed = hash.set_proof_bit(true_hashcode);
-    nodes_at_depth[d] += bit_changed;
+    mark_proved(true_hashcode, d);
     return {false, true};
 }
 
+void Search::mark_proved(uint64_t true_hashcode, int d)
+/* Set the proof bit of a position of proof_negamax; minimal proofs also record it */
+{
+    bool bit_changed = m_hash.set_proof_bit(true_hashcode);
+    m_nodes_at_depth[d] += bit_changed;
+    if (bit_changed == true && m_minimal_proof == true) {
+        m_proof_nodes.push_back(true_hashcode);
+    }
+}
+
+std::array<bool, 2> Search::parallel_proof(NoGoBoard &board, uint64_t hashcode, bool set_proof_bits)
+/* proof_negamax one depth at a time: the positions of the proof at one depth, each once, are
+ * checked in parallel and give the positions at the next depth, while the table is only read.
+ * With set_proof_bits, proved positions are not expanded again, and the proof bits are set once
+ * the whole proof holds; without, winning positions expand every losing child in the table,
+ * so that every node any proof of the board may use is checked, and m_nodes_at_depth counts
+ * the positions checked at each depth. */
+{
+    std::vector<std::vector<uint64_t>> depths = {{hashcode}};
+    int color = board.current_player;
+    std::atomic<bool> failed(false);
+    while (depths.back().empty() == false && failed == false) {
+        const std::vector<uint64_t> &nodes = depths.back();
+        uint64_t num_tasks = (nodes.size() + PROOF_BATCH - 1) / PROOF_BATCH;
+        std::vector<std::vector<uint64_t>> children(num_tasks);
+        run_parallel(num_tasks, [&](uint64_t t) {
+            NoGoBoard position(m_boardsize[0], m_boardsize[1]);
+            std::vector<int> colors;
+            uint64_t end = std::min((t + 1) * PROOF_BATCH, (uint64_t) nodes.size());
+            for (uint64_t i = t * PROOF_BATCH; i < end && failed == false; i++) {
+                if (expand_proof(position, nodes[i], color, set_proof_bits, ! set_proof_bits, colors, children[t]) == false) {
+                    failed = true;
+                }
+            }
+        });
+        std::vector<uint64_t> next_nodes;
+        for (std::vector<uint64_t> &task_children : children) {
+            next_nodes.insert(next_nodes.end(), task_children.begin(), task_children.end());
+        }
+        std::sort(next_nodes.begin(), next_nodes.end());    // transpositions are expanded once
+        next_nodes.erase(std::unique(next_nodes.begin(), next_nodes.end()), next_nodes.end());
+        depths.push_back(std::move(next_nodes));
+        color = GoBoardUtil::opponent(color);
+    }
+
+    bool value = m_hash.peek(m_hash.linear_congruence_func(hashcode)) == 1;
+    if (failed == true) {
+        return {value, false};
+    }
+    for (uint64_t d = 0; d < depths.size(); d++) {
+        if (set_proof_bits == false) {
+            m_nodes_at_depth[d] += depths[d].size();
+            continue;
+        }
+        for (uint64_t &node : depths[d]) {
+            node = m_hash.linear_congruence_func(node);
+        }
+        m_nodes_at_depth[d] += m_hash.set_proof_bits(depths[d]);
+    }
+    return {value, true};
+}
+
+bool Search::expand_proof(NoGoBoard &position, uint64_t hashcode, int color, bool skip_proved, bool all_losing,
+                          std::vector<int> &colors, std::vector<uint64_t> &children)
+/* Add the children that the proof of a position needs, as in proof_negamax: the first losing child
+ * of a winning position, or with all_losing every losing child, and every child of a losing one.
+ * The position is set up on position from its hashcode. Return false if the table disagrees with the rules. */
+{
+    uint64_t true_hashcode = m_hash.linear_congruence_func(hashcode);
+    int value = m_hash.peek(true_hashcode);
+    if (value == -1) {
+        return false;
+    }
+    if (skip_proved == true && m_hash.get_proof_bit(true_hashcode) == true) {
+        return true;
+    }
+
+    m_hash.colors_of(hashcode, colors);
+    for (int p = 0; p < m_num_points; p++) {
+        position.board[GoBoardUtil::canonical_point_to_point(p, m_boardsize)] = colors[p];
+    }
+    position.current_player = color;
+    bool has_losing_child = false;
+    for (int move : position.generate_legal_moves(color)) {
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, move, color);
+        int next_value = m_hash.peek(m_hash.linear_congruence_func(next_hashcode));
+        if (value == 1 && next_value == 0) {
+            children.push_back(next_hashcode);
+            if (all_losing == false) {
+                return true;
+            }
+            has_losing_child = true;
+        }
+        if (value == 0) {
+            if (next_value != 1) {
+                return false;
+            }
+            children.push_back(next_hashcode);
+        }
+    }
+    return value == 0 || has_losing_child;      // a winning position needs a losing child; terminal positions are losing
+}
+
+bool Search::extract_strategy(NoGoBoard &board, uint64_t hashcode, std::vector<std::pair<uint64_t, int>> &strategy,
+                              std::unordered_set<uint64_t> &visited)
+/* Follow the solution from board: at winning positions, the move to the first losing child
+ * in the proof, or else to the first losing child, which is added to strategy with the hashcode of the position;
+ * at losing positions, every move. Return false if a position on the way is not solved. */
+{
+    uint64_t true_hashcode = m_hash.linear_congruence_func(hashcode);
+    if (visited.insert(true_hashcode).second == false) {
+        return true;
+    }
+    int value = m_hash.get(true_hashcode);
+    if (value == -1) {
+        return false;
+    }
+
+    std::vector<int> valid_moves = board.generate_legal_moves(board.current_player);
+    if (value == 1) {
+        int i = h_etc(hashcode, valid_moves, board.current_player);
+        if (i == -1) {
+            return false;
+        }
+        for (int j = i; j < (int) valid_moves.size(); j++) {
+            if (m_etc_values[j] == 0 && m_hash.get_proof_bit(m_etc_hashcodes[j])) {
+                i = j;      // the move of a minimal proof need not be the first one
+                break;
+            }
+        }
+        valid_moves = {valid_moves[i]};
+        strategy.push_back({true_hashcode, GoBoardUtil::point_to_canonical_point(valid_moves[0], m_boardsize)});
+    }
+
+    for (int move : valid_moves) {
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, move, board.current_player);
+        bool played = board.play_move(move, board.current_player);
+        assert(played);
+        bool solved = extract_strategy(board, next_hashcode, strategy, visited);
+        board.undo_move(move);
+        if (solved == false) {
+            return false;
+        }
+    }
+    return true;
+}
+
 int Search::h_history_heuristic(int side2move, std::vector<int> &legal_moves)
 {
     int length = (int) legal_moves.size();
@@ -182,20 +431,86 @@ int Search::h_etc(uint64_t hashcode, std::vector<int> &legal_moves, int color)
 {
     int length = (int) legal_moves.size();
 
+    m_etc_hashcodes.resize(length);
     for (int i = 0; i < length; i++) {
-        uint64_t new_hashcode = hash.hash_func(hashcode, legal_moves[i], color);
-        uint64_t true_new_hashcode = hash.linear_congruence_func(new_hashcode);
-        int value = hash.get(true_new_hashcode);
-        if (value == 0) {
+        uint64_t new_hashcode = m_hash.hash_func(hashcode, legal_moves[i], color);
+        m_etc_hashcodes[i] = m_hash.linear_congruence_func(new_hashcode);
+    }
+    m_hash.get_many(m_etc_hashcodes, m_etc_values);
+    for (int i = 0; i < length; i++) {
+        if (m_etc_values[i] == 0) {
             return i;
         }
     }
     return -1;
 }
 
+int Search::h_smallest_proof(NoGoBoard &board, uint64_t hashcode, std::vector<int> &legal_moves)
+/* Find the losing child with the smallest proof tree in the table.
+ * Returns the idx of its move; if no losing child can be proved, returns -1 */
+{
+    int best_idx = -1;
+    uint64_t best_size = PROOF_SIZE_UNKNOWN;
+    for (int i = 0; i < (int) legal_moves.size(); i++) {
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, legal_moves[i], board.current_player);
+        bool played = board.play_move(legal_moves[i], board.current_player);
+        assert(played);
+        uint64_t size = proof_tree_size(board, next_hashcode, 0);
+        board.undo_move(legal_moves[i]);
+        if (size < best_size) {
+            best_size = size;
+            best_idx = i;
+        }
+    }
+    return best_idx;
+}
+
+uint64_t Search::proof_tree_size(NoGoBoard &board, uint64_t hashcode, int value)
+/* Number of nodes of the smallest proof in the table that board has this value, as a tree:
+ * transpositions count once per path to them, which estimates the shared DAG from above.
+ * Nodes with the proof bit, left by an earlier proof, count nothing themselves, so that a
+ * retry prefers the moves into it. PROOF_SIZE_UNKNOWN if there is none; sizes saturate
+ * just below it. Memoized in m_proof_sizes. */
+{
+    uint64_t true_hashcode = m_hash.linear_congruence_func(hashcode);
+    if (m_hash.get(true_hashcode) != value) {
+        return PROOF_SIZE_UNKNOWN;
+    }
+    std::unordered_map<uint64_t, uint64_t>::iterator found = m_proof_sizes.find(true_hashcode);
+    if (found != m_proof_sizes.end()) {
+        return found->second;
+    }
+
+    std::vector<int> valid_moves = board.generate_legal_moves(board.current_player);
+    uint64_t own = m_hash.get_proof_bit(true_hashcode) ? 0 : 1;
+    uint64_t size = value == 1 ? PROOF_SIZE_UNKNOWN : own;
+    for (int move : valid_moves) {
+        uint64_t next_hashcode = m_hash.hash_func(hashcode, move, board.current_player);
+        bool played = board.play_move(move, board.current_player);
+        assert(played);
+        uint64_t child_size = proof_tree_size(board, next_hashcode, 1 - value);
+        board.undo_move(move);
+
+        if (child_size == PROOF_SIZE_UNKNOWN) {
+            if (value == 0) {
+                size = PROOF_SIZE_UNKNOWN;  // one unproved reply is enough
+                break;
+            }
+        }
+        else if (value == 1) {
+            size = std::min(size, std::min(child_size, PROOF_SIZE_UNKNOWN - 2) + own);
+        }
+        else {
+            size = child_size < PROOF_SIZE_UNKNOWN - 1 - size ? size + child_size : PROOF_SIZE_UNKNOWN - 1;
+        }
+    }
+    m_proof_sizes[true_hashcode] = size;
+    return size;
+}
+
 unsigned long Search::num_nodes_searched()
 {
-    return node_count;
+    return m_node_count;
 }
 
 void Search::update_hhtable(int side2move, int point, int depth)
@@ -226,7 +541,7 @@ void Search::print_verify_stats()
 {
     std::cerr << "in this solution...\n";
     for (int i = 0; i < m_num_points; i++) {
-        std::cerr << "nodes at depth " << i << ": " << nodes_at_depth[i] << std::endl;
+        std::cerr << "nodes at depth " << i << ": " << m_nodes_at_depth[i] << std::endl;
     }
     return;
 }
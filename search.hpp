@@ -1,21 +1,77 @@
 #ifndef SEARCH_H
 #define SEARCH_H
 
+#include <unordered_set>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
 #include "hash.hpp"
 #include "board.hpp"
 
 
-extern Hash hash;
+// limits of a solve are checked every BUDGET_CHECK_NODES nodes
+const uint64_t BUDGET_CHECK_NODES = 1 << 12;
+
+// a solve prints its speed every PROGRESS_REPORT_SECONDS, from its own thread
+const double PROGRESS_REPORT_SECONDS = 10;
+
+struct SolveBudget
+/* Limits of a solve, 0 for none. The thread that started the solve sets start, may read
+ * nodes_searched meanwhile, and may set stop_reason to abort it. */
+{
+    double seconds = 0;
+    uint64_t nodes = 0;
+    uint64_t memory = 0;        // bytes of resident memory the solve may add to start_memory
+    std::chrono::steady_clock::time_point start;
+    uint64_t start_memory = 0;  // bytes of resident memory at start
+    std::atomic<uint64_t> nodes_searched{0};
+    std::atomic<uint64_t> estimated_nodes{0};   // of the whole solve, 0 until estimated
+    std::atomic<const char*> stop_reason{nullptr};    // why the solve stopped early, if it did
+
+    void restart();
+};
+
+// the move loops of a solve down to this depth below its root estimate its size
+const int PROGRESS_DEPTH = 6;
+
+struct ProgressFrame
+/* The move loop of a node near the root of a solve, in node counts of the solve */
+{
+    int num_moves = 0;
+    int moves_done = 0;
+    uint64_t start = 0;         // count when the loop began
+    uint64_t done_nodes = 0;    // nodes under the moves done
+    uint64_t move_start = 0;    // count when the move in progress began
+};
+
+// proof_tree_size of positions the table cannot prove
+const uint64_t PROOF_SIZE_UNKNOWN = UINT64_MAX;
 
 
 class Search
 {
 public:
+    Hash& m_hash;       // transposition table of this solver instance
     int m_boardsize[2];
     int m_num_points;
     std::vector<std::vector<uint64_t>> m_hhtable;   // history heuristic table
-
-    Search(int height, int width);
+    uint64_t m_node_count = 0;
+    uint64_t m_nodes_at_depth[100] = { 0 };
+    std::vector<uint64_t> m_etc_hashcodes;  // batch of child hashcodes probed by h_etc
+    std::vector<int> m_etc_values;
+    SolveBudget* m_budget = 0;      // of the solve in progress, if it has one; held by pointer,
+                                    // as searches are copied
+    uint64_t m_budget_nodes = 0;
+    std::chrono::steady_clock::time_point m_report_time;   // of the last speed report of the solve
+    uint64_t m_report_nodes = 0;    // m_budget_nodes then
+    int m_root_depth = 0;       // of the solve in progress
+    std::vector<ProgressFrame> m_progress;  // by depth below the root
+    bool m_minimal_proof = false;   // proof_negamax picks the winning move of the smallest proof
+    std::unordered_map<uint64_t, uint64_t> m_proof_sizes;   // by true hashcode, for minimal proofs
+    std::vector<uint64_t> m_proof_nodes;    // true hashcodes proved by a minimal proof, to restore it
+
+    Search(Hash &hash, int height, int width);
     ~Search() {};
 
     void initialize(int height, int width);
@@ -24,10 +80,19 @@ public:
 
     std::array<bool, 2> proof_negamax(NoGoBoard &board, uint64_t hashcode, int d=0);
 
+    std::array<bool, 2> parallel_proof(NoGoBoard &board, uint64_t hashcode, bool set_proof_bits=true);
+
+    bool extract_strategy(NoGoBoard &board, uint64_t hashcode, std::vector<std::pair<uint64_t, int>> &strategy,
+                          std::unordered_set<uint64_t> &visited);
+
     int h_history_heuristic(int side2move, std::vector<int> &legal_moves);
 
     int h_etc(uint64_t hashcode, std::vector<int> &legal_moves, int color);
 
+    int h_smallest_proof(NoGoBoard &board, uint64_t hashcode, std::vector<int> &legal_moves);
+
+    uint64_t proof_tree_size(NoGoBoard &board, uint64_t hashcode, int value);
+
     void print_hhtable();
 
     unsigned long num_nodes_searched();
@@ -35,11 +100,24 @@ public:
     void print_verify_stats();
 
 private:
+    bool budget_spent();
+
+    uint64_t estimate_nodes();
+
+    void mark_proved(uint64_t true_hashcode, int d);
+
+    bool expand_proof(NoGoBoard &position, uint64_t hashcode, int color, bool skip_proved, bool all_losing,
+                      std::vector<int> &colors, std::vector<uint64_t> &children);
+
     void update_hhtable(int side2move, int point, int depth);
 
     void print_search(uint64_t move, int d);
 };
 
-void sig_handler(int signum);
+/* Resident memory of the process, from /proc/self/statm; 0 where there is none */
+uint64_t resident_bytes();
+
+/* Physical memory of the machine */
+uint64_t physical_bytes();
 
 #endif